@@ -1,3 +1,11 @@
-require 'mkmf' 
+require 'mkmf'
+require File.join(File.dirname(File.expand_path(__FILE__)), 'gentables')
+
+# static lookup tables included by the C sources
+GenTables.write
+
+# the RS coding of large symbols is done with the GVL released
+have_header('ruby/thread.h') && have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
 dir_config("semacode_native")
-create_makefile('semacode_native')
\ No newline at end of file
+create_makefile('semacode_native')
@@ -0,0 +1,452 @@
+# gentables.rb
+#
+# Generates the static lookup tables used by the C encoder, so that
+# nothing has to be computed (or malloced) at run time: rstables.h for
+# reedsol.c and ecc200tables.h for iec16022ecc200.c.
+#
+# extconf.rb runs this before creating the Makefile. It can also be
+# run by hand, e.g. to build reedsol.c standalone:
+#
+#   ruby gentables.rb [directory]
+
+module GenTables
+  # ECC200 Galois Field characteristic polynomial
+  # a**8 + a**5 + a**3 + a**2 + 1
+  GF_POLY = 0x12d
+
+  # log/antilog tables for GF(256) over GF_POLY
+  def self.gf
+    log = Array.new(256, 0)
+    alog = Array.new(255, 0)
+    p = 1
+    255.times do |v|
+      alog[v] = p
+      log[p] = v
+      p <<= 1
+      p ^= GF_POLY if p & 0x100 != 0
+    end
+    [log, alog]
+  end
+
+  # Largest number of RS check symbols in any ECC200 block
+  MAX_NSYM = 68
+
+  # RS generator polynomial (x + 2**i)*(x + 2**(i+1))*... with nsym terms,
+  # low order coefficient first - as built by rs_init_code in reedsol.c
+  def self.genpoly(nsym, index = 1)
+    log, alog = gf
+    poly = [1]
+    1.upto(nsym) do |i|
+      poly[i] = 1
+      (i - 1).downto(1) do |k|
+        poly[k] = alog[(log[poly[k]] + index) % 255] if poly[k] != 0
+        poly[k] ^= poly[k - 1]
+      end
+      poly[0] = alog[(log[poly[0]] + index) % 255]
+      index += 1
+    end
+    poly
+  end
+
+  # C initialiser body for a list of numbers, 16 per line
+  def self.cdata(values)
+    values.each_slice(16).map { |row| "   " + row.join(", ") }.join(",\n")
+  end
+
+  def self.rstables
+    log, alog = gf
+    starts = []
+    polys = []
+    0.upto(MAX_NSYM) do |nsym|
+      starts << polys.size
+      polys.concat(genpoly(nsym))
+    end
+    mul = (0..255).map do |a|
+      (0..255).map { |b| a == 0 || b == 0 ? 0 : alog[(log[a] + log[b]) % 255] }
+    end
+    <<EOF
+// rstables.h - generated by gentables.rb, do not edit
+
+// log/antilog tables for the ECC200 field, GF(256) with poly 0x#{GF_POLY.to_s(16)}
+static const int rs_log12d[256] = {
+#{cdata(log)}
+};
+
+static const int rs_alog12d[255] = {
+#{cdata(alog)}
+};
+
+// ECC200 generator polynomials (index 1) for 0..#{MAX_NSYM} check symbols.
+// The nsym+1 coefficients for nsym start at rs_poly12d[rs_poly12d_start[nsym]]
+#if RS_MAXNSYM12D != #{MAX_NSYM}
+#error "RS_MAXNSYM12D does not match gentables.rb"
+#endif
+
+static const int rs_poly12d_start[#{MAX_NSYM + 1}] = {
+#{cdata(starts)}
+};
+
+static const int rs_poly12d[#{polys.size}] = {
+#{cdata(polys)}
+};
+
+// GF(256) product table, rs_mul12d[a][b] is a * b
+static const unsigned char rs_mul12d[256][256] = {
+#{mul.map { |row| "  {\n" + cdata(row) + "\n  }" }.join(",\n")}
+};
+
+// Split nibble products for SIMD (PSHUFB) multiplies by m:
+// rs_nib12d[m][0][x] is m * x and rs_nib12d[m][1][x] is m * (x << 4)
+static const unsigned char rs_nib12d[256][2][16] = {
+#{mul.map { |row| "  {{" + row[0, 16].join(", ") + "},\n   {" + (0..15).map { |x| row[x << 4] }.join(", ") + "}}" }.join(",\n")}
+};
+EOF
+  end
+
+  # ECC200 symbol sizes as [H, W, FH, FW, bytes, datablock, rsblock,
+  # need], FHxFW being the data regions with their borders, bytes the
+  # data codewords, taken datablock at a time with rsblock ecc each, and
+  # need the IEC16022_ flags needed to pick the size automatically. They
+  # are tried in this order: squares, then rectangles smallest first.
+  ECC200_SIZES = [
+    [10, 10, 10, 10, 3, 3, 5, "0"],
+    [12, 12, 12, 12, 5, 5, 7, "0"],
+    [14, 14, 14, 14, 8, 8, 10, "0"],
+    [16, 16, 16, 16, 12, 12, 12, "0"],
+    [18, 18, 18, 18, 18, 18, 14, "0"],
+    [20, 20, 20, 20, 22, 22, 18, "0"],
+    [22, 22, 22, 22, 30, 30, 20, "0"],
+    [24, 24, 24, 24, 36, 36, 24, "0"],
+    [26, 26, 26, 26, 44, 44, 28, "0"],
+    [32, 32, 16, 16, 62, 62, 36, "0"],
+    [36, 36, 18, 18, 86, 86, 42, "0"],
+    [40, 40, 20, 20, 114, 114, 48, "0"],
+    [44, 44, 22, 22, 144, 144, 56, "0"],
+    [48, 48, 24, 24, 174, 174, 68, "0"],
+    [52, 52, 26, 26, 204, 102, 42, "0"],
+    [64, 64, 16, 16, 280, 140, 56, "0"],
+    [72, 72, 18, 18, 368, 92, 36, "0"],
+    [80, 80, 20, 20, 456, 114, 48, "0"],
+    [88, 88, 22, 22, 576, 144, 56, "0"],
+    [96, 96, 24, 24, 696, 174, 68, "0"],
+    [104, 104, 26, 26, 816, 136, 56, "0"],
+    [120, 120, 20, 20, 1050, 175, 68, "0"],
+    [132, 132, 22, 22, 1304, 163, 62, "0"],
+    [144, 144, 24, 24, 1558, 156, 62, "0"],      # 156*4+155*2
+    # rectangular, only picked when asked for, smallest first. DMRE
+    # (ISO/IEC 21471) sizes need IEC16022_DMRE as well
+    [8, 18, 8, 18, 5, 5, 7, "IEC16022_RECT"],
+    [8, 32, 8, 16, 10, 10, 11, "IEC16022_RECT"],
+    [12, 26, 12, 26, 16, 16, 14, "IEC16022_RECT"],
+    [8, 48, 8, 24, 18, 18, 15, "IEC16022_RECT | IEC16022_DMRE"],
+    [12, 36, 12, 18, 22, 22, 18, "IEC16022_RECT"],
+    [8, 64, 8, 16, 24, 24, 18, "IEC16022_RECT | IEC16022_DMRE"],
+    [16, 36, 16, 18, 32, 32, 24, "IEC16022_RECT"],
+    [8, 80, 8, 20, 32, 32, 22, "IEC16022_RECT | IEC16022_DMRE"],
+    [8, 96, 8, 24, 38, 38, 28, "IEC16022_RECT | IEC16022_DMRE"],
+    [12, 64, 12, 16, 43, 43, 27, "IEC16022_RECT | IEC16022_DMRE"],
+    [20, 36, 20, 18, 44, 44, 28, "IEC16022_RECT | IEC16022_DMRE"],
+    [16, 48, 16, 24, 49, 49, 28, "IEC16022_RECT"],
+    [8, 120, 8, 20, 49, 49, 32, "IEC16022_RECT | IEC16022_DMRE"],
+    [20, 44, 20, 22, 56, 56, 34, "IEC16022_RECT | IEC16022_DMRE"],
+    [16, 64, 16, 16, 62, 62, 36, "IEC16022_RECT | IEC16022_DMRE"],
+    [8, 144, 8, 24, 63, 32, 18, "IEC16022_RECT | IEC16022_DMRE"],   # 32+31
+    [12, 88, 12, 22, 64, 64, 36, "IEC16022_RECT | IEC16022_DMRE"],
+    [26, 40, 26, 20, 70, 70, 38, "IEC16022_RECT | IEC16022_DMRE"],
+    [22, 48, 22, 24, 72, 72, 38, "IEC16022_RECT | IEC16022_DMRE"],
+    [24, 48, 24, 24, 80, 80, 41, "IEC16022_RECT | IEC16022_DMRE"],
+    [20, 64, 20, 16, 84, 84, 42, "IEC16022_RECT | IEC16022_DMRE"],
+    [26, 48, 26, 24, 90, 90, 42, "IEC16022_RECT | IEC16022_DMRE"],
+    [24, 64, 24, 16, 108, 108, 46, "IEC16022_RECT | IEC16022_DMRE"],
+    [26, 64, 26, 16, 118, 118, 50, "IEC16022_RECT | IEC16022_DMRE"]
+  ]
+
+  # Annex M placement of the codewords in an nr x nc data region. Each
+  # module gets (codeword + 1) * 8 + bit, or 1 for the fixed corner
+  # modules - rows are as the placement algorithm counts them, top down
+  def self.placement(nr, nc)
+    a = Array.new(nr * nc, 0)
+    bit = lambda do |r, c, p, b|
+      if r < 0
+        r += nr
+        c += 4 - ((nr + 4) % 8)
+      end
+      if c < 0
+        c += nc
+        r += 4 - ((nc + 4) % 8)
+      end
+      # wraps past the bottom in some DMRE sizes (ISO/IEC 21471 Annex E)
+      r -= nr if r >= nr
+      a[r * nc + c] = (p << 3) + b
+    end
+    block = lambda do |r, c, p|
+      [[-2, -2], [-2, -1], [-1, -2], [-1, -1], [-1, 0], [0, -2], [0, -1], [0, 0]].each_with_index do |(dr, dc), i|
+        bit.call(r + dr, c + dc, p, 7 - i)
+      end
+    end
+    p = 1
+    r = 4
+    c = 0
+    loop do
+      # check corner, the modules of the corner codeword from bit 7 down
+      corner = if r == nr && c == 0
+                 [[nr - 1, 0], [nr - 1, 1], [nr - 1, 2], [0, nc - 2], [0, nc - 1], [1, nc - 1], [2, nc - 1], [3, nc - 1]]
+               elsif r == nr - 2 && c == 0 && nc % 4 != 0
+                 [[nr - 3, 0], [nr - 2, 0], [nr - 1, 0], [0, nc - 4], [0, nc - 3], [0, nc - 2], [0, nc - 1], [1, nc - 1]]
+               elsif r == nr - 2 && c == 0 && nc % 8 == 4
+                 [[nr - 3, 0], [nr - 2, 0], [nr - 1, 0], [0, nc - 2], [0, nc - 1], [1, nc - 1], [2, nc - 1], [3, nc - 1]]
+               elsif r == nr + 4 && c == 2 && nc % 8 == 0
+                 [[nr - 1, 0], [nr - 1, nc - 1], [0, nc - 3], [0, nc - 2], [0, nc - 1], [1, nc - 3], [1, nc - 2], [1, nc - 1]]
+               end
+      if corner
+        corner.each_with_index { |(cr, cc), i| bit.call(cr, cc, p, 7 - i) }
+        p += 1
+      end
+      # up/right
+      loop do
+        if r < nr && c >= 0 && a[r * nc + c] == 0
+          block.call(r, c, p)
+          p += 1
+        end
+        r -= 2
+        c += 2
+        break unless r >= 0 && c < nc
+      end
+      r += 1
+      c += 3
+      # down/left
+      loop do
+        if r >= 0 && c < nc && a[r * nc + c] == 0
+          block.call(r, c, p)
+          p += 1
+        end
+        r += 2
+        c -= 2
+        break unless r < nr && c >= 0
+      end
+      r += 3
+      c += 1
+      break unless r < nr || c < nc
+    end
+    # unfilled corner
+    a[nr * nc - 1] = a[nr * nc - nc - 2] = 1 if a[nr * nc - 1] == 0
+    a
+  end
+
+  # For each codeword of an HxW symbol, the grid offsets (y * W + x,
+  # bottom row first, as iec16022ecc200 returns the grid) of the modules
+  # of its bits 0 to 7, and the offsets of any modules always dark
+  def self.scatter(h, w, fh, fw)
+    nr = h - 2 * (h / fh)
+    nc = w - 2 * (w / fw)
+    map = placement(nr, nc)
+    to = []
+    dark = []
+    map.each_with_index do |v, i|
+      y = nr - 1 - i / nc
+      x = i % nc
+      off = (1 + y + 2 * (y / (fh - 2))) * w + 1 + x + 2 * (x / (fw - 2))
+      if v == 1
+        dark << off
+      elsif v > 7
+        to[((v >> 3) - 1) * 8 + (v & 7)] = off
+      end
+    end
+    raise "#{h}x#{w}: codeword bits not all placed" if to.include?(nil)
+    [to, dark]
+  end
+
+  # The fixed modules of an HxW symbol, one per module bottom row first:
+  # the solid L and alternating timing borders of every region, and the
+  # always dark corner modules of some sizes
+  def self.template(h, w, fh, fw, dark)
+    grid = Array.new(w * h, 0)
+    0.step(h - 1, fh) do |y|
+      w.times { |x| grid[y * w + x] = 1 }
+      0.step(w - 1, 2) { |x| grid[(y + fh - 1) * w + x] = 1 }
+    end
+    0.step(w - 1, fw) do |x|
+      h.times { |y| grid[y * w + x] = 1 }
+      0.step(h - 1, 2) { |y| grid[y * w + x + fw - 1] = 1 }
+    end
+    dark.each { |off| grid[off] = 1 }
+    grid
+  end
+
+  # a template packed as iec16022ecc200packed does it
+  def self.pack(grid, h, w)
+    stride = (w + 63) / 64 * 8
+    (h - 1).downto(0).flat_map do |y|
+      grid[y * w, w].each_slice(8).map { |bits| bits.each_with_index.sum { |b, i| b << (7 - i) } }
+        .fill(0, (w + 7) / 8, stride - (w + 7) / 8)
+    end
+  end
+
+  # C40, Text and X12 character sets as ecc200encode uses them
+  C40_BASIC = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+  TEXT_BASIC = " 0123456789abcdefghijklmnopqrstuvwxyz"
+  X12_SET = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\r*>"
+  SHIFT2 = "!\"\#$%&'()*+,-./:;<=>?@[\\]^_"
+  C40_SHIFT3 = "`abcdefghijklmnopqrstuvwxyz{|}~\x7f"
+  TEXT_SHIFT3 = "`ABCDEFGHIJKLMNOPQRSTUVWXYZ{|}~\x7f"
+
+  # index of byte c in set, nil if it is not in it (NUL never is)
+  def self.cindex(set, c)
+    c == 0 ? nil : set.index(c.chr)
+  end
+
+  # C40 or Text values for byte c, nil if it cannot be encoded
+  def self.ctvalues(c, basic, shift3)
+    vals = []
+    if c & 0x80 != 0
+      vals += [1, 30]           # upper shift
+      c &= 0x7f
+    end
+    if (w = cindex(basic, c))
+      vals << (w + 3) % 40
+    elsif c < 32
+      vals += [0, c]
+    elsif (w = cindex(SHIFT2, c))
+      vals += [1, w]
+    elsif (w = cindex(shift3, c))
+      vals += [2, w]
+    else
+      return nil
+    end
+    vals
+  end
+
+  # C40 or Text values counted for byte c when planning: those in the
+  # basic set (space, digits and upper or lower case letters) take one
+  def self.ctcost(c, letters)
+    cost = c & 0x80 != 0 ? 2 : 0
+    c &= 0x7f
+    cost + (c == 32 || (48..57).cover?(c) || letters.cover?(c) ? 1 : 2)
+  end
+
+  # the encodation classes of every byte, without regard to the locale
+  def self.classes
+    (0..255).map do |c|
+      flags = 0
+      flags |= 1 if (48..57).cover?(c)
+      flags |= 2 if [13, 42, 62, 32].include?(c) || (48..57).cover?(c) || (65..90).cover?(c)
+      flags |= 4 if (32..94).cover?(c)
+      c40 = ctvalues(c, C40_BASIC, C40_SHIFT3) || []
+      text = ctvalues(c, TEXT_BASIC, TEXT_SHIFT3) || []
+      x12 = c & 0x80 == 0 && (w = cindex(X12_SET, c)) ? (w + 3) % 40 : 255
+      "  {#{flags}, #{ctcost(c, 65..90)}, #{ctcost(c, 97..122)}, " \
+        "#{c40.size}, {#{(c40 + [0] * 4)[0, 4].join(", ")}}, " \
+        "#{text.size}, {#{(text + [0] * 4)[0, 4].join(", ")}}, #{x12}}"
+    end
+  end
+
+  def self.ecc200tables
+    data = []
+    packdata = []
+    tmpl = []
+    packtmpl = []
+    matrix = ECC200_SIZES.map { |size| "  {#{size.join(", ")}}" }
+    sizes = ECC200_SIZES.map do |h, w, fh, fw|
+      to, dark = scatter(h, w, fh, fw)
+      stride = (w + 63) / 64 * 8
+      # grid offset to packed bit: byte (row * stride + x / 8) * 8 + shift
+      pack = lambda { |off| ((h - 1 - off / w) * stride + off % w / 8) * 8 + 7 - off % w % 8 }
+      entry = "  {#{h}, #{w}, #{data.size}, #{to.size / 8}, #{tmpl.size}, #{packtmpl.size}}"
+      data.concat(to)
+      packdata.concat(to.map(&pack))
+      t = template(h, w, fh, fw, dark)
+      tmpl.concat(t)
+      packtmpl.concat(pack(t, h, w))
+      entry
+    end
+    <<EOF
+// ecc200tables.h - generated by gentables.rb, do not edit
+
+// Annex M placement of every ECC200 size, as scatter tables: for each
+// codeword, the offsets in the grid (y * W + x, bottom row first) of
+// the modules for its bits 0 to 7.  The table for HxW starts at
+// ecc200scatterdata[start].
+static const unsigned short ecc200scatterdata[#{data.size}] = {
+#{cdata(data)}
+};
+
+// The same for the bit packed form of the symbol: rows top down, each
+// padded to a multiple of 64 bits, the leftmost module in the top bit of
+// the first byte.  Each entry is the byte offset * 8 + the bit's shift.
+static const unsigned short ecc200packdata[#{packdata.size}] = {
+#{cdata(packdata)}
+};
+
+// Templates of the fixed modules (finder and timing patterns, and the
+// corner modules always dark) for each size, to copy before scattering
+// the codewords.  One char per module, bottom row first, starting at
+// ecc200templatedata[tmpl], and packed as for ecc200packdata starting
+// at ecc200packtemplatedata[packtmpl].
+static const unsigned char ecc200templatedata[#{tmpl.size}] = {
+#{cdata(tmpl)}
+};
+
+static const unsigned char ecc200packtemplatedata[#{packtmpl.size}] = {
+#{cdata(packtmpl)}
+};
+
+// Encodation classes of each byte, for planning and encoding
+#define ECC200_DIGIT 1          // ASCII digit, two may be encoded as one
+#define ECC200_X12 2            // in the X12 set
+#define ECC200_EDIFACT 4        // in the EDIFACT set
+
+static const struct ecc200class_s
+{
+   unsigned char flags;         // ECC200_ flags
+   unsigned char c40cost,       // C40 and Text values counted when planning
+     textcost;
+   unsigned char c40n,          // C40 values when encoding, 0 if it cannot be
+     c40[4];
+   unsigned char textn,         // the same for Text
+     text[4];
+   unsigned char x12;           // X12 value, 255 if it cannot be
+} ecc200classtab[256] = {
+#{classes.join(",\n")}
+};
+
+// The ECC200 sizes, in the order they are tried, with their capacities
+static struct ecc200matrix_s
+{
+   int H,
+     W;
+   int FH,
+     FW;
+   int bytes;
+   int datablock,
+     rsblock;
+   int need;                    // IEC16022_ flags needed to pick it automatically
+} ecc200matrix[] = {
+#{matrix.join(",\n")},
+  {0}                           // terminate
+};
+
+// The scatter table of each size, in the order of ecc200matrix
+static const struct ecc200scatter_s
+{
+   int H,
+     W,
+     start,
+     codewords,
+     tmpl,
+     packtmpl;
+} ecc200scattertab[] = {
+#{sizes.join(",\n")},
+  {0}                           // terminate
+};
+EOF
+  end
+
+  def self.write(dir = ".")
+    File.open(File.join(dir, "rstables.h"), "w") { |f| f.write(rstables) }
+    File.open(File.join(dir, "ecc200tables.h"), "w") { |f| f.write(ecc200tables) }
+  end
+end
+
+if $0 == __FILE__
+  GenTables.write(ARGV[0] || File.dirname(__FILE__))
+end
@@ -23,232 +23,546 @@
 
 
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <time.h>
 #include "ruby.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
 #include "reedsol.h"
 #include "iec16022ecc200.h"
+#include "ecc200tables.h"       // generated by gentables.rb
 
-static struct ecc200matrix_s
+#define ECC200RECT(m) ((m)->W != (m)->H)
+
+// is the size one that may be picked automatically with these flags,
+// the rectangles (rect 1) or squares (rect 0) being tried, and its
+// longer side within any IEC16022_MINSIDE and IEC16022_MAXSIDE
+static int
+ecc200pickable (struct ecc200matrix_s *matrix, int flags, int rect)
 {
-   int H,
-     W;
-   int FH,
-     FW;
-   int bytes;
-   int datablock,
-     rsblock;
+   int side = matrix->W > matrix->H ? matrix->W : matrix->H,
+      max = (flags >> 16) & 255;
+   return ECC200RECT (matrix) == rect && !(matrix->need & ~flags) && side >= ((flags >> 8) & 255) && (!max || side <= max);
+}
+
+// Annex M placement scatter table for a size, prebuilt by gentables.rb
+// along with ecc200matrix, in the same order
+static const struct ecc200scatter_s *
+ecc200scatter (struct ecc200matrix_s *matrix)
+{
+   return ecc200scattertab + (matrix - ecc200matrix);
 }
-ecc200matrix[] =
-{
-   10, 10, 10, 10, 3, 3, 5,     //
-      12, 12, 12, 12, 5, 5, 7,  //
-      14, 14, 14, 14, 8, 8, 10, //
-      16, 16, 16, 16, 12, 12, 12,       //
-      18, 18, 18, 18, 18, 18, 14,       //
-      20, 20, 20, 20, 22, 22, 18,       //
-      22, 22, 22, 22, 30, 30, 20,       //
-      24, 24, 24, 24, 36, 36, 24,       //
-      26, 26, 26, 26, 44, 44, 28,       //
-      32, 32, 16, 16, 62, 62, 36,       //
-      36, 36, 18, 18, 86, 86, 42,       //
-      40, 40, 20, 20, 114, 114, 48,     //
-      44, 44, 22, 22, 144, 144, 56,     //
-      48, 48, 24, 24, 174, 174, 68,     //
-      52, 52, 26, 26, 204, 102, 42,     //
-      64, 64, 16, 16, 280, 140, 56,     //
-      72, 72, 18, 18, 368, 92, 36,      //
-      80, 80, 20, 20, 456, 114, 48,     //
-      88, 88, 22, 22, 576, 144, 56,     //
-      96, 96, 24, 24, 696, 174, 68,     //
-      104, 104, 26, 26, 816, 136, 56,   //
-      120, 120, 20, 20, 1050, 175, 68,  //
-      132, 132, 22, 22, 1304, 163, 62,  //
-      144, 144, 24, 24, 1558, 156, 62,  // 156*4+155*2
-      0                         // terminate
-};
 
-// Annex M placement alorithm low level
+// calculate and append ecc code, and if necessary interleave
 static void
-ecc200placementbit (int *array, int NR, int NC, int r, int c, int p, char b)
+ecc200 (unsigned char *binary, int bytes, int datablock, int rsblock)
 {
-   if (r < 0)
+   int blocks = (bytes + 2) / datablock;
+   rs_codec rs = { 0 };         // own codec, so this can run without the GVL
+   rs_codec_init_gf (&rs, 0x12d);
+   rs_codec_init_code (&rs, rsblock, 1);
+   if (blocks == 1)
    {
-      r += NR;
-      c += 4 - ((NR + 4) % 8);
+      unsigned char ecc[256];
+      int n;
+      rs_codec_encode (&rs, bytes, binary, ecc);
+      for (n = 0; n < rsblock; n++)
+         binary[bytes + n] = ecc[rsblock - 1 - n];      // comes back reversed
+   } else                       // all blocks at once, straight from and to the interleaved codewords
+      rs_codec_encode_lanes (&rs, blocks, (bytes + blocks - 1) / blocks, bytes % blocks ? bytes % blocks : blocks, binary, blocks, binary + bytes, blocks);
+   rs_codec_free (&rs);
+}
+
+// calculate and append ecc code for n symbols of the same size at once,
+// every RS block of every symbol being one lane of rs_codec_encode_batch
+#define ECC200_BATCH 480        // lanes per pass, a multiple of 32 and of every block count (1, 2, 4, 6, 8, 10)
+static void
+ecc200batch (int n, unsigned char *const *binary, int bytes, int datablock, int rsblock)
+{
+   int blocks = (bytes + 2) / datablock,
+      per = ECC200_BATCH / blocks,     // symbols per pass
+      i;
+   rs_codec rs = { 0 };
+   rs_codec_init_gf (&rs, 0x12d);
+   rs_codec_init_code (&rs, rsblock, 1);
+   for (i = 0; i < n; i += per)
+   {
+      unsigned char *data[ECC200_BATCH],
+       *res[ECC200_BATCH];
+      int len[ECC200_BATCH],
+        lanes = 0,
+         m,
+         b;
+      for (m = i; m < n && m < i + per; m++)
+         for (b = 0; b < blocks; b++, lanes++)
+         {
+            data[lanes] = binary[m] + b;
+            res[lanes] = binary[m] + bytes + b;
+            len[lanes] = (bytes - b + blocks - 1) / blocks;
+         }
+      rs_codec_encode_batch (&rs, lanes, len, data, blocks, res, blocks);
    }
-   if (c < 0)
+   rs_codec_free (&rs);
+}
+
+// append the ecc codewords to n buffers of data codewords for a WxH symbol
+int
+iec16022ecc200batch (int W, int H, int n, unsigned char *const *binary)
+{
+   struct ecc200matrix_s *matrix;
+   for (matrix = ecc200matrix; matrix->W && (matrix->W != W || matrix->H != H); matrix++);
+   if (!matrix->W)
+      return 0;
+   ecc200batch (n, binary, matrix->bytes, matrix->datablock, matrix->rsblock);
+   return 1;
+}
+
+// check the ecc of the codewords (interleaved, as ecc200 lays them out)
+static int
+ecc200check (const unsigned char *binary, int bytes, int datablock, int rsblock)
+{
+   int blocks = (bytes + 2) / datablock,
+      ok = 1,
+      b;
+   rs_codec rs = { 0 };
+   rs_codec_init_gf (&rs, 0x12d);
+   rs_codec_init_code (&rs, rsblock, 1);
+   for (b = 0; b < blocks && ok; b++)
    {
-      c += NC;
-      r += 4 - ((NC + 4) % 8);
+      unsigned char buf[256];
+      int n = 0,
+         p;
+      for (p = b; p < bytes; p += blocks)
+         buf[n++] = binary[p];
+      for (p = 0; p < rsblock; p++)
+         buf[n++] = binary[bytes + p * blocks + b];
+      ok = rs_codec_check (&rs, n, buf);
    }
-   array[r * NC + c] = (p << 3) + b;
+   rs_codec_free (&rs);
+   return ok;
 }
 
-static void
-ecc200placementblock (int *array, int NR, int NC, int r, int c, int p)
+// check the ecc of the len codewords for a WxH symbol
+// Returns 1 if all the blocks are valid, 0 if not, -1 if they do not fit WxH
+int
+iec16022ecc200check (int W, int H, int len, const unsigned char *binary)
 {
-   ecc200placementbit (array, NR, NC, r - 2, c - 2, p, 7);
-   ecc200placementbit (array, NR, NC, r - 2, c - 1, p, 6);
-   ecc200placementbit (array, NR, NC, r - 1, c - 2, p, 5);
-   ecc200placementbit (array, NR, NC, r - 1, c - 1, p, 4);
-   ecc200placementbit (array, NR, NC, r - 1, c - 0, p, 3);
-   ecc200placementbit (array, NR, NC, r - 0, c - 2, p, 2);
-   ecc200placementbit (array, NR, NC, r - 0, c - 1, p, 1);
-   ecc200placementbit (array, NR, NC, r - 0, c - 0, p, 0);
+   struct ecc200matrix_s *matrix;
+   for (matrix = ecc200matrix; matrix->W && (matrix->W != W || matrix->H != H); matrix++);
+   if (!matrix->W || len != matrix->bytes + (matrix->bytes + 2) / matrix->datablock * matrix->rsblock)
+      return -1;
+   return ecc200check (binary, matrix->bytes, matrix->datablock, matrix->rsblock);
 }
 
-static void
-ecc200placementcornerA (int *array, int NR, int NC, int p)
+// correct the codewords (interleaved, as ecc200 lays them out) in place,
+// erase listing nerase codeword indexes known to be bad
+// Returns the number of codewords corrected, -1 if any block is beyond correction
+static int
+ecc200correct (unsigned char *binary, int bytes, int datablock, int rsblock, int nerase, const int *erase)
 {
-   ecc200placementbit (array, NR, NC, NR - 1, 0, p, 7);
-   ecc200placementbit (array, NR, NC, NR - 1, 1, p, 6);
-   ecc200placementbit (array, NR, NC, NR - 1, 2, p, 5);
-   ecc200placementbit (array, NR, NC, 0, NC - 2, p, 4);
-   ecc200placementbit (array, NR, NC, 0, NC - 1, p, 3);
-   ecc200placementbit (array, NR, NC, 1, NC - 1, p, 2);
-   ecc200placementbit (array, NR, NC, 2, NC - 1, p, 1);
-   ecc200placementbit (array, NR, NC, 3, NC - 1, p, 0);
+   int blocks = (bytes + 2) / datablock,
+      total = 0,
+      b;
+   rs_codec rs = { 0 };
+   rs_codec_init_gf (&rs, 0x12d);
+   rs_codec_init_code (&rs, rsblock, 1);
+   for (b = 0; b < blocks && total >= 0; b++)
+   {
+      unsigned char buf[256];
+      int at[256],              // codeword index of each byte of the block
+        be[256],
+        ne = 0,
+         n = 0,
+         p,
+         c;
+      for (p = b; p < bytes; p += blocks)
+         at[n++] = p;
+      for (p = 0; p < rsblock; p++)
+         at[n++] = bytes + p * blocks + b;
+      for (p = 0; p < n; p++)
+         buf[p] = binary[at[p]];
+      for (c = 0; c < nerase; c++)
+         for (p = 0; p < n; p++)
+            if (at[p] == erase[c] && ne < rsblock)
+               be[ne++] = p;
+            else if (at[p] == erase[c])
+               total = -1;      // more erasures than check codewords
+      c = total < 0 ? -1 : rs_codec_decode (&rs, n, buf, ne, be);
+      if (c < 0)
+         total = -1;
+      else
+      {
+         total += c;
+         for (p = 0; p < n; p++)
+            binary[at[p]] = buf[p];
+      }
+   }
+   rs_codec_free (&rs);
+   return total;
 }
 
-static void
-ecc200placementcornerB (int *array, int NR, int NC, int p)
+// correct the len codewords for a WxH symbol in place
+int
+iec16022ecc200correct (int W, int H, int len, unsigned char *binary, int nerase, const int *erase)
 {
-   ecc200placementbit (array, NR, NC, NR - 3, 0, p, 7);
-   ecc200placementbit (array, NR, NC, NR - 2, 0, p, 6);
-   ecc200placementbit (array, NR, NC, NR - 1, 0, p, 5);
-   ecc200placementbit (array, NR, NC, 0, NC - 4, p, 4);
-   ecc200placementbit (array, NR, NC, 0, NC - 3, p, 3);
-   ecc200placementbit (array, NR, NC, 0, NC - 2, p, 2);
-   ecc200placementbit (array, NR, NC, 0, NC - 1, p, 1);
-   ecc200placementbit (array, NR, NC, 1, NC - 1, p, 0);
+   struct ecc200matrix_s *matrix;
+   for (matrix = ecc200matrix; matrix->W && (matrix->W != W || matrix->H != H); matrix++);
+   if (!matrix->W || len != matrix->bytes + (matrix->bytes + 2) / matrix->datablock * matrix->rsblock)
+      return -2;
+   return ecc200correct (binary, matrix->bytes, matrix->datablock, matrix->rsblock, nerase, erase);
 }
 
-static void
-ecc200placementcornerC (int *array, int NR, int NC, int p)
+// the 255 state randomising of Annex H for the codeword at (0 based) position p
+static int
+ecc200random (int v, int p, int states)
 {
-   ecc200placementbit (array, NR, NC, NR - 3, 0, p, 7);
-   ecc200placementbit (array, NR, NC, NR - 2, 0, p, 6);
-   ecc200placementbit (array, NR, NC, NR - 1, 0, p, 5);
-   ecc200placementbit (array, NR, NC, 0, NC - 2, p, 4);
-   ecc200placementbit (array, NR, NC, 0, NC - 1, p, 3);
-   ecc200placementbit (array, NR, NC, 1, NC - 1, p, 2);
-   ecc200placementbit (array, NR, NC, 2, NC - 1, p, 1);
-   ecc200placementbit (array, NR, NC, 3, NC - 1, p, 0);
+   v += ((p + 1) * 149) % states + 1;
+   return v > 255 ? v - 256 : v;
 }
 
-static void
-ecc200placementcornerD (int *array, int NR, int NC, int p)
+// undo the 253/255 state randomising of Annex H for the codeword at (0 based) position p
+static int
+ecc200unrandom (int v, int p, int states)
 {
-   ecc200placementbit (array, NR, NC, NR - 1, 0, p, 7);
-   ecc200placementbit (array, NR, NC, NR - 1, NC - 1, p, 6);
-   ecc200placementbit (array, NR, NC, 0, NC - 3, p, 5);
-   ecc200placementbit (array, NR, NC, 0, NC - 2, p, 4);
-   ecc200placementbit (array, NR, NC, 0, NC - 1, p, 3);
-   ecc200placementbit (array, NR, NC, 1, NC - 3, p, 2);
-   ecc200placementbit (array, NR, NC, 1, NC - 2, p, 1);
-   ecc200placementbit (array, NR, NC, 1, NC - 1, p, 0);
+   v -= ((p + 1) * 149) % states + 1;
+   return v < 0 ? v + 256 : v;
 }
 
-// Annex M placement alorithm main function
-static void
-ecc200placement (int *array, int NR, int NC)
-{
-   int r,
-     c,
-     p;
-   // invalidate
-   for (r = 0; r < NR; r++)
-      for (c = 0; c < NC; c++)
-         array[r * NC + c] = 0;
-   // start
-   p = 1;
-   r = 4;
-   c = 0;
-   do
+// decode data codewords (decodation, section 5.2), t must have room for 2 * bytes + 9
+// Returns the message length, -1 if the codewords are not a valid encoding
+static int
+ecc200decode (unsigned char *t, const unsigned char *b, int bytes)
+{
+   static const char *c40[4] = {
+      " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ", 0,
+      "!\"#$%&'()*+,-./:;<=>?@[\\]^_",
+      "`abcdefghijklmnopqrstuvwxyz{|}~\177"
+   },
+   *text[4] = {
+      " 0123456789abcdefghijklmnopqrstuvwxyz", 0,
+      "!\"#$%&'()*+,-./:;<=>?@[\\]^_",
+      "`ABCDEFGHIJKLMNOPQRSTUVWXYZ{|}~\177"
+   },
+   *x12 = "\r*> 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+   int tp = 0,
+      bp = 0,
+      upper = 0,                // upper shift pending
+      macro = 0;
+   while (bp < bytes)
    {
-      // check corner
-      if (r == NR && !c)
-         ecc200placementcornerA (array, NR, NC, p++);
-      if (r == NR - 2 && !c && NC % 4)
-         ecc200placementcornerB (array, NR, NC, p++);
-      if (r == NR - 2 && !c && (NC % 8) == 4)
-         ecc200placementcornerC (array, NR, NC, p++);
-      if (r == NR + 4 && c == 2 && !(NC % 8))
-         ecc200placementcornerD (array, NR, NC, p++);
-      // up/right
-      do
+      int c = b[bp++];
+      if (c >= 1 && c <= 128)
       {
-         if (r < NR && c >= 0 && !array[r * NC + c])
-            ecc200placementblock (array, NR, NC, r, c, p++);
-         r -= 2;
-         c += 2;
-      }
-      while (r >= 0 && c < NC);
-      r++;
-      c += 3;
-      // down/left
-      do
+         t[tp++] = c - 1 + upper;
+         upper = 0;
+      } else if (c == 129)
+         break;                 // pad
+      else if (c >= 130 && c <= 229)
       {
-         if (r >= 0 && c < NC && !array[r * NC + c])
-            ecc200placementblock (array, NR, NC, r, c, p++);
-         r += 2;
-         c -= 2;
+         t[tp++] = '0' + (c - 130) / 10;
+         t[tp++] = '0' + (c - 130) % 10;
+      } else if (c == 235)
+         upper = 128;
+      else if (c == 232)
+         t[tp++] = 29;          // FNC1, as GS
+      else if ((c == 236 || c == 237) && bp == 1)
+      {
+         memcpy (t, c == 236 ? "[)>\03605\035" : "[)>\03606\035", 7);
+         tp = 7;
+         macro = 1;
+      } else if (c == 230 || c == 239 || c == 238)
+      {                         // C40, Text, X12, 3 values in 2 codewords
+         const char **set = c == 230 ? c40 : text;
+         int shift = 0;
+         while (bp + 1 < bytes && b[bp] != 254)
+         {
+            int v = b[bp] * 256 + b[bp + 1] - 1,
+               val[3],
+               k;
+            bp += 2;
+            val[0] = v / 1600;
+            val[1] = v / 40 % 40;
+            val[2] = v % 40;
+            if (v < 0 || val[0] >= 40)
+               return -1;
+            for (k = 0; k < 3; k++)
+            {
+               int u = val[k];
+               if (c == 238)
+               {
+                  t[tp++] = x12[u];
+                  continue;
+               }
+               if (!shift && u < 3)
+               {
+                  shift = u + 1;
+                  continue;
+               }
+               if (shift == 1)
+                  t[tp++] = u + upper;
+               else if (shift == 2 && u == 27)
+                  t[tp++] = 29; // FNC1
+               else if (shift == 2 && u == 30)
+               {
+                  upper = 128;
+                  shift = 0;
+                  continue;
+               } else if ((shift == 2 && u < 27) || (shift == 3 && u < 32))
+                  t[tp++] = set[shift][u] + upper;
+               else if (!shift)
+                  t[tp++] = set[0][u - 3] + upper;
+               else
+                  return -1;
+               upper = 0;
+               shift = 0;
+            }
+         }
+         if (bp < bytes && b[bp] == 254)
+            bp++;               // unlatch, else a single codeword left is ASCII
+      } else if (c == 240)
+      {                         // EDIFACT, 4 values of 6 bits in 3 codewords
+         int bits = 0,
+            nbits = 0;
+         while (1)
+         {
+            int v;
+            if (!nbits && bytes - bp <= 2)
+               break;           // the last 1 or 2 codewords are ASCII
+            if (nbits < 6)
+            {
+               if (bp >= bytes)
+                  break;
+               bits = (bits << 8) | b[bp++];
+               nbits += 8;
+            }
+            v = (bits >> (nbits - 6)) & 0x3F;
+            nbits -= 6;
+            if (v == 0x1F)
+               break;           // unlatch, the rest of the codeword is dropped
+            t[tp++] = v < 32 ? v + 64 : v;
+         }
+      } else if (c == 231)
+      {                         // Base 256
+         int l = ecc200unrandom (b[bp], bp, 255);
+         bp++;
+         if (l == 0)
+            l = bytes - bp;     // to the end
+         else if (l >= 250)
+         {
+            if (bp >= bytes)
+               return -1;
+            l = 250 * (l - 249) + ecc200unrandom (b[bp], bp, 255);
+            bp++;
+         }
+         if (bp + l > bytes)
+            return -1;
+         while (l--)
+         {
+            t[tp++] = ecc200unrandom (b[bp], bp, 255);
+            bp++;
+         }
+      } else
+         return -1;             // structured append, reader programming, ECI or invalid
+   }
+   if (macro)
+   {
+      memcpy (t + tp, "\036\004", 2);
+      tp += 2;
+   }
+   return tp;
+}
+
+// decode the data codewords of a WxH symbol to its message
+int
+iec16022ecc200decode (int W, int H, const unsigned char *binary, unsigned char *message)
+{
+   struct ecc200matrix_s *matrix;
+   for (matrix = ecc200matrix; matrix->W && (matrix->W != W || matrix->H != H); matrix++);
+   if (!matrix->W)
+      return -1;
+   return ecc200decode (message, binary, matrix->bytes);
+}
+
+// read the codewords (data and ecc) back out of a WxH grid
+// Returns the number of codewords, 0 if WxH is not an ECC200 size.
+int
+iec16022ecc200codewords (int W, int H, const unsigned char *grid, unsigned char *binary)
+{
+   struct ecc200matrix_s *matrix;
+   const struct ecc200scatter_s *sc;
+   const unsigned short *from;
+   int k;
+   for (matrix = ecc200matrix; matrix->W && (matrix->W != W || matrix->H != H); matrix++);
+   if (!matrix->W)
+      return 0;
+   sc = ecc200scatter (matrix);
+   from = ecc200scatterdata + sc->start;
+   for (k = 0; k < sc->codewords; k++, from += 8)
+      binary[k] = (grid[from[0]] != 0) | (grid[from[1]] != 0) << 1 | (grid[from[2]] != 0) << 2 | (grid[from[3]] != 0) << 3
+         | (grid[from[4]] != 0) << 4 | (grid[from[5]] != 0) << 5 | (grid[from[6]] != 0) << 6 | (grid[from[7]] != 0) << 7;
+   return sc->codewords;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+// ecc200 touches no Ruby objects and no globals, so for the larger
+// (interleaved) symbols it is run with the GVL released, letting other
+// Ruby threads encode at the same time.
+#define ECC200_NOGVL_BYTES 204  // 52x52 and up
+
+struct ecc200_args
+{
+   unsigned char *binary;
+   int bytes,
+     datablock,
+     rsblock;
+};
+
+static void *
+ecc200_nogvl (void *p)
+{
+   struct ecc200_args *a = p;
+   ecc200 (a->binary, a->bytes, a->datablock, a->rsblock);
+   return NULL;
+}
+#endif
+
+// encoding list letters are either case, whatever the locale
+#define ENCLOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 'a' - 'A' : (c))
+
+// Encoding modes, as letters in an encoding list
+static char encchr[] = "ACTXEB";
+
+enum
+{
+   E_ASCII,
+   E_C40,
+   E_TEXT,
+   E_X12,
+   E_EDIFACT,
+   E_BINARY,
+   E_MAX
+};
+
+unsigned char switchcost[E_MAX][E_MAX] = {
+   0, 1, 1, 1, 1, 2,            // From E_ASCII
+   1, 0, 2, 2, 2, 3,            // From E_C40
+   1, 2, 0, 2, 2, 3,            // From E_TEXT
+   1, 2, 2, 0, 2, 3,            // From E_X12
+   1, 2, 2, 2, 0, 3,            // From E_EDIFACT
+   0, 1, 1, 1, 1, 0,            // From E_BINARY
+};
+
+// encplan state per source position and encoding mode
+struct ecc200enc_s
+{
+   short s;                     // number of bytes of source that can be encoded in a row at this point using this encoding mode
+   short t;                     // number of bytes of target generated encoding from this point to end if already in this encoding mode
+};
+
+// The mode encpick (below) picks at row p of a plan made by encplan
+// (below), after mode cur
+static char
+encstep (struct ecc200enc_s (*enc)[E_MAX], int p, char cur, char exact)
+{
+   int t,
+     m = 0;
+   char b = 0,
+      e;
+   for (e = 0; e < E_MAX; e++)
+   {
+      int c = switchcost[cur][e];
+      if (exact && e == E_ASCII && cur != E_BINARY && enc[p][e].t <= (cur == E_EDIFACT ? 2 : 1))
+         c = 0;                 // no unlatch for the last bytes
+      if (enc[p][e].t && ((t = enc[p][e].t + c) < m || (t == m && e == cur) || !m))
+      {
+         b = e;
+         m = t;
       }
-      while (r < NR && c >= 0);
-      r += 3;
-      c++;
    }
-   while (r < NR || c < NC);
-   // unfilled corner
-   if (!array[NR * NC - 1])
-      array[NR * NC - 1] = array[NR * NC - NC - 2] = 1;
+   return b;
 }
 
-// calculate and append ecc code, and if necessary interleave
+// Where ecc200encode takes the mode of each byte from: an encoding list,
+// or a plan, picking the modes as the bytes are encoded rather than
+// making a list of them first
+struct encmodes_s
+{
+   const char *encoding;        // the list, if not null
+   struct ecc200enc_s (*plan)[E_MAX];   // else the plan,
+   char exact;                  // as for an exact fit,
+   char *out;                   // writing the list picked here, if not null
+   int l;                       // the bytes to encode
+   int p;                       // the next mode picked from the plan starts here
+   char cur;                    // the mode picked before that
+};
+
+// Sets modes to take them from encoding, for sl bytes
+// owned (may be null) is freed before raising an error
 static void
-ecc200 (unsigned char *binary, int bytes, int datablock, int rsblock)
+encmodeslist (struct encmodes_s *modes, const char *encoding, int sl, char *owned)
 {
-   int blocks = (bytes + 2) / datablock, b;
-   rs_init_gf (0x12d);
-   rs_init_code (rsblock, 1);
-   for (b = 0; b < blocks; b++)
+   if (strlen (encoding) < sl)
    {
-      unsigned char buf[256],
-        ecc[256];
-      int n,
-        p = 0;
-      for (n = b; n < bytes; n += blocks)
-         buf[p++] = binary[n];
-      rs_encode (p, buf, ecc);
-      p = rsblock - 1;          // comes back reversed
-      for (n = b; n < rsblock * blocks; n += blocks)
-         binary[bytes + n] = ecc[p--];
+     free(owned);
+      rb_raise(rb_eArgError,  "encoding string too short");
    }
+   memset (modes, 0, sizeof (*modes));
+   modes->encoding = encoding;
 }
 
-// perform encoding for ecc200, source s len sl, to target t len tl, using optional encoding control string e
+// Sets modes to pick them from plan for l bytes, as encpick would,
+// writing the list of them to out (l + 1 bytes) too if not null
+static void
+encmodesplan (struct encmodes_s *modes, struct ecc200enc_s (*plan)[E_MAX], char exact, int l, char *out)
+{
+   memset (modes, 0, sizeof (*modes));
+   modes->plan = plan;
+   modes->exact = exact;
+   modes->out = out;
+   modes->l = l;
+   modes->cur = E_ASCII;        // starts ASCII
+   if (out)
+      out[l] = 0;
+}
+
+// The mode of byte q, asked for in order
+static inline char
+encmode (struct encmodes_s *modes, int q)
+{
+   if (modes->encoding)
+      return ENCLOWER (modes->encoding[q]);
+   while (q >= modes->p)
+   {
+      int n = modes->plan[modes->p][modes->cur = encstep (modes->plan, modes->p, modes->cur, modes->exact)].s;
+      if (n > modes->l - modes->p)
+         n = modes->l - modes->p;
+      if (modes->out)
+         memset (modes->out + modes->p, encchr[(int) modes->cur], n);
+      modes->p += n;
+   }
+   return ENCLOWER (encchr[(int) modes->cur]);
+}
+
+// perform encoding for ecc200, source s len sl, to target t len tl, taking the modes from modes
 // return 1 if OK, 0 if failed. Does all necessary padding to tl
+// owned (may be null) is freed before raising an error
 char
-ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding, int *lenp)
+ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, const struct encmodes_s *modes, int *lenp, char *owned)
 {
+   struct encmodes_s m = *modes;        // from the start each time
    char enc = 'a';              // start in ASCII encoding mode
    int tp = 0,
       sp = 0;
-   if (strlen (encoding) < sl)
-   {
-     free(encoding);
-      rb_raise(rb_eArgError,  "encoding string too short");
-      return 0;
-   }
    // do the encoding
    while (sp < sl && tp < tl)
    {
       char newenc = enc;        // suggest new encoding
-      if (tl - tp <= 1 && (enc == 'c' || enc == 't') || tl - tp <= 2 && enc == 'x')
+      if ((tl - tp <= 1 && (enc == 'c' || enc == 't' || enc == 'x')) || (tl - tp <= 2 && enc == 'e'))
          enc = 'a';             // auto revert to ASCII
-      newenc = tolower (encoding[sp]);
+      newenc = encmode (&m, sp);
+      if (newenc == 'e' && tl - tp - (enc == 'e' ? 0 : enc == 'a' ? 1 : 2) <= 2)
+         newenc = 'a';          // no EDIFACT group in the last 2 codewords, they are ASCII
       switch (newenc)
       {                         // encode character
       case 'c':                // C40
@@ -257,76 +571,29 @@ ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding
          {
             char out[6],
               p = 0;
-            const char *e,
-             *s2 = "!\"#$%&'()*+,-./:;<=>?@[\\]_",
-               *s3 = 0;
-            if (newenc == 'c')
-            {
-               e = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-               s3 = "`abcdefghijklmnopqrstuvwxyz{|}~\177";
-            }
-            if (newenc == 't')
-            {
-               e = " 0123456789abcdefghijklmnopqrstuvwxyz";
-               s3 = "`ABCDEFGHIJKLMNOPQRSTUVWXYZ{|}~\177";
-            }
-            if (newenc == 'x')
-               e = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\r*>";
             do
             {
-               unsigned char c = s[sp++];
-               char *w;
-               if (c & 0x80)
+               const struct ecc200class_s *k = &ecc200classtab[s[sp++]];
+               const unsigned char *v = newenc == 'c' ? k->c40 : k->text;
+               int n = newenc == 'x' ? 0 : newenc == 'c' ? k->c40n : k->textn;
+               if (newenc == 'x')
                {
-                  if (newenc == 'x')
+                  if (k->x12 == 255)
                   {
-                     free(encoding);
-                     rb_raise(rb_eArgError,  "cannot encode character in X12", c);
+                     free(owned);
+                     rb_raise(rb_eArgError,  "cannot encode character in X12", s[sp - 1]);
                      return 0;
                   }
-                  c &= 0x7f;
-                  out[p++] = 1;
-                  out[p++] = 30;
-               }
-               w = strchr (e, c);
-               if (w)
-                  out[p++] = ((w - e) + 3) % 40;
-               else
+                  out[p++] = k->x12;
+               } else if (!n)
                {
-                  if (newenc == 'x')
-                  {
-                     free(encoding);
-                     rb_raise(rb_eArgError,  "cannot encode character in X12", c);
-                     return 0;
-                  }
-                  if (c < 32)
-                  {             // shift 1
-                     out[p++] = 0;
-                     out[p++] = c;
-                  } else
-                  {
-                     w = strchr (s2, c);
-                     if (w)
-                     {          // shift 2
-                        out[p++] = 1;
-                        out[p++] = (w - s2);
-                     } else
-                     {
-                        w = strchr (s3, c);
-                        if (w)
-                        {
-                           out[p++] = 2;
-                           out[p++] = (w - s3);
-                        } else
-                        {
-                           free(encoding);
-                           rb_raise(rb_eRuntimeError,  "this should not be happening!", c);
-                           return 0;
-                        }
-                     }
-                  }
+                  free(owned);
+                  rb_raise(rb_eRuntimeError,  "this should not be happening!", s[sp - 1]);
+                  return 0;
                }
-               if (p == 2 && tp + 2 == tl && sp == sl)
+               while (n--)
+                  out[p++] = *v++;
+               if (p == 2 && sp == sl)
                   out[p++] = 0; // shift 1 pad at end
                while (p >= 3)
                {
@@ -335,7 +602,7 @@ ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding
                   {
                      if (enc == 'c' || enc == 't' || enc == 'x')
                         t[tp++] = 254;  // escape C40/text/X12
-                     else if (enc == 'x')
+                     else if (enc == 'e')
                         t[tp++] = 0x7C; // escape EDIFACT
                      if (newenc == 'c')
                         t[tp++] = 230;
@@ -354,35 +621,46 @@ ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding
                }
             }
             while (p && sp < sl);
+            if (p)
+            {
+               if (lenp)
+                  *lenp = tp;
+               return 0;        // a value left at the end, which needs ASCII
+            }
          }
          break;
       case 'e':                // EDIFACT
          {
-            unsigned char out[4],
+            unsigned char out[4] = { 0 },
               p = 0;
+            int v;
             if (enc != newenc)
-            {                   // can only be from C40/Text/X12
-               t[tp++] = 254;
-               enc = 'a';
+            {
+               if (enc == 'c' || enc == 't' || enc == 'x')
+                  t[tp++] = 254;        // escape C40/text/X12
+               t[tp++] = 240;
+               enc = 'e';
+            }
+            while (sp < sl && encmode (&m, sp) == 'e' && p < 4)
+            {
+               if (s[sp] < 32 || s[sp] > 94)
+               {
+                  free(owned);
+                  rb_raise(rb_eArgError,  "cannot encode character in EDIFACT");
+                  return 0;
+               }
+               out[p++] = s[sp++] & 0x3F;
             }
-            while (sp < sl && tolower (encoding[sp]) == 'e' && p < 4)
-               out[p++] = s[sp++];
             if (p < 4)
             {
                out[p++] = 0x1F;
                enc = 'a';
             }                   // termination
-            t[tp] = ((s[0] & 0x3F) << 2);
-            t[tp++] |= ((s[1] & 0x30) >> 4);
-            t[tp] = ((s[1] & 0x0F) << 4);
-            if (p == 2)
-               tp++;
-            else
-            {
-               t[tp++] |= ((s[2] & 0x3C) >> 2);
-               t[tp] = ((s[2] & 0x03) << 6);
-               t[tp++] |= (s[3] & 0x3F);
-            }
+            v = out[0] << 18 | out[1] << 12 | (p > 2 ? out[2] << 6 : 0) | (p > 3 ? out[3] : 0);
+            t[tp++] = v >> 16;
+            t[tp++] = v >> 8;
+            if (p > 2)
+               t[tp++] = v;     // 1 value and the termination take 2 codewords
          }
          break;
       case 'a':                // ASCII
@@ -394,7 +672,7 @@ ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding
                t[tp++] = 0x7C;  // escape EDIFACT
          }
          enc = 'a';
-         if (sl - sp >= 2 && isdigit (s[sp]) && isdigit (s[sp + 1]))
+         if (sl - sp >= 2 && (ecc200classtab[s[sp]].flags & ecc200classtab[s[sp + 1]].flags & ECC200_DIGIT))
          {
             t[tp++] = (s[sp] - '0') * 10 + s[sp + 1] - '0' + 130;
             sp += 2;
@@ -407,37 +685,42 @@ ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding
          break;
       case 'b':                // Binary
          {
-            int l = 0;          // how much to encode
-            if (encoding)
-            {
-               int p;
-               for (p = sp; p < sl && tolower (encoding[p]) == 'b'; p++)
-                  l++;
-            }
+            int l = 0,          // how much to encode
+               p;
+            for (p = sp; p < sl && encmode (&m, p) == 'b'; p++)
+               l++;
+            if (enc == 'c' || enc == 't' || enc == 'x')
+               t[tp++] = 254;   // escape C40/text/X12
+            else if (enc == 'e')
+               t[tp++] = 0x7C;  // escape EDIFACT
             t[tp++] = 231;      // base256
-            if (l < 250)
-               t[tp++] = l;
-            else
+            if (l >= 250)
             {
-               t[tp++] = 249 + (l / 250);
-               t[tp++] = (l % 250);
+               t[tp] = ecc200random (249 + (l / 250), tp, 255);
+               tp++;
             }
+            t[tp] = ecc200random (l % 250, tp, 255);    // see annex H
+            tp++;
             while (l-- && tp < tl)
             {
-               t[tp] = s[sp++] + (((tp + 1) * 149) % 255) + 1;  // see annex H
+               t[tp] = ecc200random (s[sp++], tp, 255);
                tp++;
             }
             enc = 'a';          // reverse to ASCII at end
          }
          break;
       default:
-         free(encoding);
+         free(owned);
          rb_raise(rb_eArgError,  "unknown encoding attempted");
          return 0;              // failed
       }
    }
+   if (m.out && sp == sl && sl)
+      encmode (&m, sl - 1);     // list the rest, which a last C40, Text or X12 triple may have taken whatever their mode
    if (lenp)
       *lenp = tp;
+   if (enc == 'e' && tl - tp <= 2)
+      enc = 'a';                // auto revert to ASCII
    if (tp < tl && enc != 'a')
    {
       if (enc == 'c' || enc == 'x' || enc == 't')
@@ -461,345 +744,715 @@ ecc200encode (unsigned char *t, int tl, unsigned char *s, int sl, char *encoding
 }
 
 // Auto encoding format functions
-static char encchr[] = "ACTXEB";
 
-enum
+// Works out row p of the encplan state from the rows after it, as for
+// an exact fit if exact is set (see encplan)
+// returns how far ahead it looked
+static int
+encrow (struct ecc200enc_s (*enc)[E_MAX], int p, int l, unsigned char *s, char exact)
 {
-   E_ASCII,
-   E_C40,
-   E_TEXT,
-   E_X12,
-   E_EDIFACT,
-   E_BINARY,
-   E_MAX
-};
-
-unsigned char switchcost[E_MAX][E_MAX] = {
-   0, 1, 1, 1, 1, 2,            // From E_ASCII
-   1, 0, 2, 2, 2, 3,            // From E_C40
-   1, 2, 0, 2, 2, 3,            // From E_TEXT
-   1, 2, 2, 0, 2, 3,            // From E_X12
-   1, 2, 2, 2, 0, 3,            // From E_EDIFACT
-   0, 1, 1, 1, 1, 0,            // From E_BINARY
-};
-
-// Creates a encoding list (malloc)
-// returns encoding string
-// if lenp not null, target len stored
-// if error, null returned
-// if exact specified, then assumes shortcuts applicable for exact fit in target
-// 1. No unlatch to return to ASCII for last encoded byte after C40 or Text or X12
-// 2. No unlatch to return to ASCII for last 1 or 2 encoded bytes after EDIFACT
-// 3. Final C40 or text encoding exactly in last 2 bytes can have a shift 0 to pad to make a tripple
-// Only use the encoding from an exact request if the len matches the target, otherwise free the result and try again with exact=0
-static char *
-encmake (int l, unsigned char *s, int *lenp, char exact)
-{
-  VALUE rb_str = NULL;
-   char *encoding = 0;
-   int p = l;
-   char e;
-   struct
-   {
-      short s;                  // number of bytes of source that can be encoded in a row at this point using this encoding mode
-      short t;                  // number of bytes of target generated encoding from this point to end if already in this encoding mode
-   } enc[MAXBARCODE][E_MAX];
-   memset (&enc, 0, sizeof (enc));
-   if (!l)
-      return "";                // no length
-   if (l > MAXBARCODE)
-      return 0;                 // not valid
-   while (p--)
+   char b = 0,
+      sub,
+      e;
+   int sl,
+     tl,
+     bl,
+     t,
+     reach = 4;                 // EDIFACT and binary look at most 4 ahead
+   memset (enc[p], 0, sizeof (*enc));  // modes that cannot encode from here stay 0
+   // consider each encoding from this point
+   // ASCII
+   sl = tl = 1;
+   if (p + 1 < l && (ecc200classtab[s[p]].flags & ecc200classtab[s[p + 1]].flags & ECC200_DIGIT))
+      sl = 2;                // double digit
+   else if (s[p] & 0x80)
+      tl = 2;                // high shifted
+   bl = 0;
+   if (p + sl < l)
+      for (e = 0; e < E_MAX; e++)
+         if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_ASCII][e]) < bl || !bl))
+         {
+            bl = t;
+            b = e;
+         }
+   if (sl > reach)
+      reach = sl;
+   enc[p][E_ASCII].t = tl + bl;
+   enc[p][E_ASCII].s = sl;
+   if (bl && b == E_ASCII)
+      enc[p][b].s += enc[p + sl][b].s;
+   // C40
+   sub = tl = sl = 0;
+   do
    {
-      char b = 0,
-         sub;
-      int sl,
-        tl,
-        bl,
-        t;
-      // consider each encoding from this point
-      // ASCII
-      sl = tl = 1;
-      if (isdigit (s[p]) && p + 1 < l && isdigit (s[p + 1]))
-         sl = 2;                // double digit
-      else if (s[p] & 0x80)
-         tl = 2;                // high shifted
+      sub += ecc200classtab[s[p + sl++]].c40cost;  // with any shifts
+      while (sub >= 3)
+      {
+         sub -= 3;
+         tl += 2;
+      }
+   } while (sub && p + sl < l);
+   if (exact && sub == 2 && p + sl == l)
+   {                         // special case, can encode last block with shift 0 at end (Is this valid when not end of target buffer?)
+      sub = 0;
+      tl += 2;
+   }
+   if (sl > reach)
+      reach = sl;
+   if (!sub)
+   {                         // can encode C40
       bl = 0;
       if (p + sl < l)
          for (e = 0; e < E_MAX; e++)
-            if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_ASCII][e]) < bl || !bl))
+            if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_C40][e]) < bl || !bl))
             {
                bl = t;
                b = e;
             }
-      enc[p][E_ASCII].t = tl + bl;
-      enc[p][E_ASCII].s = sl;
-      if (bl && b == E_ASCII)
+      if (exact && enc[p + sl][E_ASCII].t == 1 && 1 < bl)
+      {                      // special case, switch to ASCII for last bytes
+         bl = 1;
+         b = E_ASCII;
+      }
+      enc[p][E_C40].t = tl + bl;
+      enc[p][E_C40].s = sl;
+      if (bl && b == E_C40)
          enc[p][b].s += enc[p + sl][b].s;
-      // C40
-      sub = tl = sl = 0;
-      do
+   }
+   // Text
+   sub = tl = sl = 0;
+   do
+   {
+      sub += ecc200classtab[s[p + sl++]].textcost; // with any shifts
+      while (sub >= 3)
       {
-         unsigned char c = s[p + sl++];
-         if (c & 0x80)
-         {                      // shift + upper
-            sub += 2;
-            c &= 0x7F;
-         }
-         if (c != ' ' && !isdigit (c) && !isupper (c))
-            sub++;              // shift
-         sub++;
-         while (sub >= 3)
-         {
-            sub -= 3;
-            tl += 2;
-         }
-      } while (sub && p + sl < l);
-      if (exact && sub == 2 && p + sl == l)
-      {                         // special case, can encode last block with shift 0 at end (Is this valid when not end of target buffer?)
-         sub = 0;
+         sub -= 3;
          tl += 2;
       }
-      if (!sub)
-      {                         // can encode C40
-         bl = 0;
-         if (p + sl < l)
-            for (e = 0; e < E_MAX; e++)
-               if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_C40][e]) < bl || !bl))
-               {
-                  bl = t;
-                  b = e;
-               }
-         if (exact && enc[p + sl][E_ASCII].t == 1 && 1 < bl)
-         {                      // special case, switch to ASCII for last bytes
-            bl = 1;
-            b = E_ASCII;
-         }
-         enc[p][E_C40].t = tl + bl;
-         enc[p][E_C40].s = sl;
-         if (bl && b == E_C40)
-            enc[p][b].s += enc[p + sl][b].s;
+   } while (sub && p + sl < l);
+   if (exact && sub == 2 && p + sl == l)
+   {                         // special case, can encode last block with shift 0 at end (Is this valid when not end of target buffer?)
+      sub = 0;
+      tl += 2;
+   }
+   if (sl > reach)
+      reach = sl;
+   if (!sub && sl)
+   {                         // can encode Text
+      bl = 0;
+      if (p + sl < l)
+         for (e = 0; e < E_MAX; e++)
+            if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_TEXT][e]) < bl || !bl))
+            {
+               bl = t;
+               b = e;
+            }
+      if (exact && enc[p + sl][E_ASCII].t == 1 && 1 < bl)
+      {                      // special case, switch to ASCII for last bytes
+         bl = 1;
+         b = E_ASCII;
       }
-      // Text
-      sub = tl = sl = 0;
-      do
+      enc[p][E_TEXT].t = tl + bl;
+      enc[p][E_TEXT].s = sl;
+      if (bl && b == E_TEXT)
+         enc[p][b].s += enc[p + sl][b].s;
+   }
+   // X12
+   sub = tl = sl = 0;
+   do
+   {
+      if (!(ecc200classtab[s[p + sl++]].flags & ECC200_X12))
       {
-         unsigned char c = s[p + sl++];
-         if (c & 0x80)
-         {                      // shift + upper
-            sub += 2;
-            c &= 0x7F;
-         }
-         if (c != ' ' && !isdigit (c) && !islower (c))
-            sub++;              // shift
-         sub++;
-         while (sub >= 3)
-         {
-            sub -= 3;
-            tl += 2;
-         }
-      } while (sub && p + sl < l);
-      if (exact && sub == 2 && p + sl == l)
-      {                         // special case, can encode last block with shift 0 at end (Is this valid when not end of target buffer?)
-         sub = 0;
+         sl = 0;
+         break;
+      }
+      sub++;
+      while (sub >= 3)
+      {
+         sub -= 3;
          tl += 2;
       }
-      if (!sub && sl)
-      {                         // can encode Text
-         bl = 0;
-         if (p + sl < l)
-            for (e = 0; e < E_MAX; e++)
-               if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_TEXT][e]) < bl || !bl))
-               {
-                  bl = t;
-                  b = e;
-               }
-         if (exact && enc[p + sl][E_ASCII].t == 1 && 1 < bl)
-         {                      // special case, switch to ASCII for last bytes
-            bl = 1;
-            b = E_ASCII;
-         }
-         enc[p][E_TEXT].t = tl + bl;
-         enc[p][E_TEXT].s = sl;
-         if (bl && b == E_TEXT)
-            enc[p][b].s += enc[p + sl][b].s;
+   } while (sub && p + sl < l);
+   if (sl > reach)
+      reach = sl;
+   if (!sub && sl)
+   {                         // can encode X12
+      bl = 0;
+      if (p + sl < l)
+         for (e = 0; e < E_MAX; e++)
+            if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_X12][e]) < bl || !bl))
+            {
+               bl = t;
+               b = e;
+            }
+      if (exact && enc[p + sl][E_ASCII].t == 1 && 1 < bl)
+      {                      // special case, switch to ASCII for last bytes
+         bl = 1;
+         b = E_ASCII;
       }
-      // X12
-      sub = tl = sl = 0;
-      do
+      enc[p][E_X12].t = tl + bl;
+      enc[p][E_X12].s = sl;
+      if (bl && b == E_X12)
+         enc[p][b].s += enc[p + sl][b].s;
+   }
+   // EDIFACT
+   sl = bl = 0;
+   if ((ecc200classtab[s[p + 0]].flags & ECC200_EDIFACT))
+   {                         // can encode 1
+      char bs = 0;
+      if (p + 1 == l && (!bl || bl < 2))
       {
-         unsigned char c = s[p + sl++];
-         if (c != 13 && c != '*' && c != '>' && c != ' ' && !isdigit (c) && !isupper (c))
-         {
-            sl = 0;
-            break;
-         }
-         sub++;
-         while (sub >= 3)
-         {
-            sub -= 3;
-            tl += 2;
-         }
-      } while (sub && p + sl < l);
-      if (!sub && sl)
-      {                         // can encode X12
-         bl = 0;
-         if (p + sl < l)
-            for (e = 0; e < E_MAX; e++)
-               if (enc[p + sl][e].t && ((t = enc[p + sl][e].t + switchcost[E_X12][e]) < bl || !bl))
-               {
-                  bl = t;
-                  b = e;
-               }
-         if (exact && enc[p + sl][E_ASCII].t == 1 && 1 < bl)
-         {                      // special case, switch to ASCII for last bytes
-            bl = 1;
-            b = E_ASCII;
-         }
-         enc[p][E_X12].t = tl + bl;
-         enc[p][E_X12].s = sl;
-         if (bl && b == E_X12)
-            enc[p][b].s += enc[p + sl][b].s;
-      }
-      // EDIFACT
-      sl = bl = 0;
-      if (s[p + 0] >= 32 && s[p + 0] <= 94)
-      {                         // can encode 1
-         char bs = 0;
-         if (p + 1 == l && (!bl || bl < 2))
+         bl = 2;
+         bs = 1;
+      } else
+         for (e = 0; e < E_MAX; e++)
+            if (e != E_EDIFACT && enc[p + 1][e].t && ((t = 2 + enc[p + 1][e].t + switchcost[E_ASCII][e]) < bl || !bl))       // E_ASCII as allowed for unlatch
+            {
+               bs = 1;
+               bl = t;
+               b = e;
+            }
+      if (p + 1 < l && (ecc200classtab[s[p + 1]].flags & ECC200_EDIFACT))
+      {                      // can encode 2
+         if (p + 2 == l && (!bl || bl < 2))
          {
-            bl = 2;
-            bs = 1;
+            bl = 3;
+            bs = 2;
          } else
             for (e = 0; e < E_MAX; e++)
-               if (e != E_EDIFACT && enc[p + 1][e].t && ((t = 2 + enc[p + 1][e].t + switchcost[E_ASCII][e]) < bl || !bl))       // E_ASCII as allowed for unlatch
+               if (e != E_EDIFACT && enc[p + 2][e].t && ((t = 3 + enc[p + 2][e].t + switchcost[E_ASCII][e]) < bl || !bl))    // E_ASCII as allowed for unlatch
                {
-                  bs = 1;
+                  bs = 2;
                   bl = t;
                   b = e;
                }
-         if (p + 1 < l && s[p + 1] >= 32 && s[p + 1] <= 94)
-         {                      // can encode 2
-            if (p + 2 == l && (!bl || bl < 2))
+         if (p + 2 < l && (ecc200classtab[s[p + 2]].flags & ECC200_EDIFACT))
+         {                   // can encode 3
+            if (p + 3 == l && (!bl || bl < 3))
             {
                bl = 3;
-               bs = 2;
+               bs = 3;
             } else
                for (e = 0; e < E_MAX; e++)
-                  if (e != E_EDIFACT && enc[p + 2][e].t && ((t = 3 + enc[p + 2][e].t + switchcost[E_ASCII][e]) < bl || !bl))    // E_ASCII as allowed for unlatch
+                  if (e != E_EDIFACT && enc[p + 3][e].t && ((t = 3 + enc[p + 3][e].t + switchcost[E_ASCII][e]) < bl || !bl)) // E_ASCII as allowed for unlatch
                   {
-                     bs = 2;
+                     bs = 3;
                      bl = t;
                      b = e;
                   }
-            if (p + 2 < l && s[p + 2] >= 32 && s[p + 2] <= 94)
-            {                   // can encode 3
-               if (p + 3 == l && (!bl || bl < 3))
+            if (p + 4 < l && (ecc200classtab[s[p + 3]].flags & ECC200_EDIFACT))
+            {                // can encode 4
+               if (p + 4 == l && (!bl || bl < 3))
                {
                   bl = 3;
-                  bs = 3;
+                  bs = 4;
                } else
+               {
                   for (e = 0; e < E_MAX; e++)
-                     if (e != E_EDIFACT && enc[p + 3][e].t && ((t = 3 + enc[p + 3][e].t + switchcost[E_ASCII][e]) < bl || !bl)) // E_ASCII as allowed for unlatch
+                     if (enc[p + 4][e].t && ((t = 3 + enc[p + 4][e].t + switchcost[E_EDIFACT][e]) < bl || !bl))
                      {
-                        bs = 3;
+                        bs = 4;
                         bl = t;
                         b = e;
                      }
-               if (p + 4 < l && s[p + 3] >= 32 && s[p + 3] <= 94)
-               {                // can encode 4
-                  if (p + 4 == l && (!bl || bl < 3))
-                  {
-                     bl = 3;
+                  if (exact && enc[p + 4][E_ASCII].t && enc[p + 4][E_ASCII].t <= 2 && (t = 3 + enc[p + 4][E_ASCII].t) < bl)
+                  {          // special case, switch to ASCII for last 1 ot two bytes
                      bs = 4;
-                  } else
-                  {
-                     for (e = 0; e < E_MAX; e++)
-                        if (enc[p + 4][e].t && ((t = 3 + enc[p + 4][e].t + switchcost[E_EDIFACT][e]) < bl || !bl))
-                        {
-                           bs = 4;
-                           bl = t;
-                           b = e;
-                        }
-                     if (exact && enc[p + 4][E_ASCII].t && enc[p + 4][E_ASCII].t <= 2 && (t = 3 + enc[p + 4][E_ASCII].t) < bl)
-                     {          // special case, switch to ASCII for last 1 ot two bytes
-                        bs = 4;
-                        bl = t;
-                        b = E_ASCII;
-                     }
+                     bl = t;
+                     b = E_ASCII;
                   }
                }
             }
          }
-         enc[p][E_EDIFACT].t = bl;
-         enc[p][E_EDIFACT].s = bs;
-         if (bl && b == E_EDIFACT)
-            enc[p][b].s += enc[p + bs][b].s;
       }
-      // Binary
-      bl = 0;
-      for (e = 0; e < E_MAX; e++)
-         if (enc[p + 1][e].t
-             && ((t = enc[p + 1][e].t + switchcost[E_BINARY][e] + ((e == E_BINARY && enc[p + 1][e].t == 249) ? 1 : 0)) < bl || !bl))
-         {
-            bl = t;
-            b = e;
-         }
-      enc[p][E_BINARY].t = 1 + bl;
-      enc[p][E_BINARY].s = 1;
-      if (bl && b == E_BINARY)
-         enc[p][b].s += enc[p + 1][b].s;
+      enc[p][E_EDIFACT].t = bl;
+      enc[p][E_EDIFACT].s = bs;
+      if (bl && b == E_EDIFACT)
+         enc[p][b].s += enc[p + bs][b].s;
+   }
+   // Binary
+   bl = 0;
+   for (e = 0; e < E_MAX; e++)
+      if (enc[p + 1][e].t
+          && ((t = enc[p + 1][e].t + switchcost[E_BINARY][e] + ((e == E_BINARY && enc[p + 1][e].t == 249) ? 1 : 0)) < bl || !bl))
+      {
+         bl = t;
+         b = e;
+      }
+   enc[p][E_BINARY].t = 1 + bl;
+   enc[p][E_BINARY].s = 1;
+   if (bl && b == E_BINARY)
+      enc[p][b].s += enc[p + 1][b].s;
+   return reach;
+}
+
+// Creates a encoding list from a plan made by encplan (below), in encoding
+// (l + 1 bytes) if not null, taking the same shortcuts as the plan if it
+// is for an exact fit
+// returns the target len
+static int
+encpick (int l, struct ecc200enc_s (*enc)[E_MAX], char exact, char *encoding)
+{
+   int p = 0,
+      len = 0;
+   char cur = E_ASCII;          // starts ASCII
+   while (p < l)
+   {
+      int m;
+      char b = encstep (enc, p, cur, exact);
+      cur = b;
+      m = enc[p][b].s;
+      if (!p)
+      {
+         len = enc[p][b].t + switchcost[E_ASCII][b];   // and any latch to start
+         if (!encoding)
+            return len;
+      }
+      while (p < l && m--)
+         encoding[p++] = encchr[b];
+   }
+   if (encoding)
+      encoding[p] = 0;
+   return len;
+}
+
+// Plans the encoding of s (l bytes): the best way to encode from each
+// point to the end, in enc (l + 1 rows), giving the encoded length in
+// *lenp. The same is done for an exact fit in the target in ex, giving
+// *exlenp, which assumes shortcuts only valid if it is the target size
+// 1. No unlatch to return to ASCII for last encoded byte after C40 or Text or X12
+// 2. No unlatch to return to ASCII for last 1 or 2 encoded bytes after EDIFACT
+// 3. Final C40 or text encoding exactly in last 2 bytes can have a shift 0 to pad to make a tripple
+// Both are worked out in one pass. The shortcuts can only change rows
+// near the end, and a row is the same in both unless one of the rows it
+// looks at differs, so the exact rows are mostly just copied.
+// A row depends only on the bytes from there to the end, so rows from p
+// on may already be planned for an earlier s with the same tail; tail (if
+// not null, l + 1 entries) keeps what is needed to carry on from any row.
+// p is l to plan all of s.
+static void
+encplan (int l, unsigned char *s, struct ecc200enc_s (*enc)[E_MAX], struct ecc200enc_s (*ex)[E_MAX], int p, short *tail, int *lenp, int *exlenp)
+{
+   int diff = p < l ? l - tail[p] : l - 4;     // rows from here may differ, shortcuts need 2 bytes or less left
+   if (p == l)
+   {
+      memset (enc[l], 0, sizeof (*enc));
+      memset (ex[l], 0, sizeof (*ex));
+   }
+   while (p--)
+   {
+      if (p + encrow (enc, p, l, s, 0) >= diff)
+      {
+         encrow (ex, p, l, s, 1);
+         if (p < diff && memcmp (ex[p], enc[p], sizeof (*enc)))
+            diff = p;
+      } else
+         memcpy (ex[p], enc[p], sizeof (*enc));
+      if (tail)
+         tail[p] = l - diff;    // as counted from the end
       //rb_raise(rb_eRuntimeError,  "%d:", p); for (e = 0; e < E_MAX; e++) rb_raise(rb_eRuntimeError,  " %c*%d/%d", encchr[e], enc[p][e].s, enc[p][e].t); rb_raise(rb_eRuntimeError,  "\n");
    }
-   encoding = ALLOC_N(char, l + 1);
-   p = 0;
+   *lenp = encpick (l, enc, 0, 0);
+   *exlenp = encpick (l, ex, 1, 0);
+}
+
+// Payloads all of one kind of byte, which encplan always encodes the same
+// way for a given length, exact fit or not
+enum
+{
+   H_MIXED,                     // anything else, needs encplan
+   H_DIGIT,                     // 0-9, digit pairs in ASCII
+   H_UPPER,                     // A-Z, C40
+   H_LOWER,                     // a-z, Text
+   H_PLAIN,                     // 7 bit, not a letter, and not X12 or EDIFACT: ASCII
+};
+
+#define ENCIN(c, lo, hi) ((unsigned char) ((c) - (lo)) <= (hi) - (lo))
+#define ENCPLAIN(c) (((c) < 32 && (c) != 13) || ENCIN (c, 95, 96) || ENCIN (c, 123, 127))
+
+// Works out the kind of payload s (l bytes) is, 32 bytes at a time where
+// the compiler has vectors, giving up as soon as it is mixed
+static int
+enckind (const unsigned char *s, int l)
+{
+   int miss = 0,                // bit per kind (1 << kind - 1) a byte was not
+      i = 0;
+#ifdef __GNUC__
+   typedef unsigned char v16 __attribute__ ((vector_size (16)));
+   v16 d = { 0 },               // lanes that were not each kind
+      u = { 0 },
+      w = { 0 },
+      a = { 0 };
+   for (; i + 32 <= l && miss != 15; i += 32)
    {
-      char cur = E_ASCII;       // starts ASCII
-      while (p < l)
+      unsigned long long q[8];
+      int h;
+      for (h = 0; h < 32; h += 16)
       {
-         int t,
-           m = 0;
-         char b = 0;
-         for (e = 0; e < E_MAX; e++)
-            if (enc[p][e].t && ((t = enc[p][e].t + switchcost[cur][e]) < m || t == m && e == cur || !m))
-            {
-               b = e;
-               m = t;
-            }
-         cur = b;
-         m = enc[p][b].s;
-         if (!p && lenp)
-            *lenp = enc[p][b].t;
-         while (p < l && m--)
-            encoding[p++] = encchr[b];
+         v16 c;
+         memcpy (&c, s + i + h, 16);
+         d |= (v16) (c - '0' > 9);
+         u |= (v16) (c - 'A' > 25);
+         w |= (v16) (c - 'a' > 25);
+         a |= (v16) ~(((c < 32) & (c != 13)) | (c - 95 <= 1) | (c - 123 <= 4));  // lane masks, so & not &&
       }
+      memcpy (q, &d, 16);
+      memcpy (q + 2, &u, 16);
+      memcpy (q + 4, &w, 16);
+      memcpy (q + 6, &a, 16);
+      miss = (!!(q[0] | q[1])) | ((!!(q[2] | q[3])) << 1) | ((!!(q[4] | q[5])) << 2) | ((!!(q[6] | q[7])) << 3);
+   }
+#endif
+   for (; i < l && miss != 15; i++)
+   {
+      unsigned char c = s[i];
+      miss |= (!ENCIN (c, '0', '9')) | ((!ENCIN (c, 'A', 'Z')) << 1) | ((!ENCIN (c, 'a', 'z')) << 2) | ((!ENCPLAIN (c)) << 3);
+   }
+   if (!l || miss == 15)
+      return H_MIXED;
+   for (i = H_DIGIT; miss & 1; i++)
+      miss >>= 1;
+   return i;
+}
+
+// The encoding encplan picks for l bytes of one kind (from enckind), in
+// encoding (l + 1 bytes) if not null
+// returns the target len, as encpick would
+static int
+encsame (int l, int kind, char *encoding)
+{
+   int a = l,                   // ASCII bytes at the start
+      len = l;
+   if (kind == H_DIGIT)
+      len = (l + 1) / 2;        // digit pairs
+   else if ((kind == H_UPPER || kind == H_LOWER) && l >= 6)
+   {                            // triples, with any left over in ASCII first
+      a = l % 3;
+      len = a + 1 + l / 3 * 2;  // and the latch
+   }
+   if (encoding)
+   {
+      memset (encoding, 'A', a);
+      memset (encoding + a, kind == H_UPPER ? 'C' : 'T', l - a);
+      encoding[l] = 0;
    }
-   encoding[p] = 0;
-   return encoding;
+   return len;
+}
+
+// Picks the first size flags allow for an encoding of len bytes, or
+// exlen bytes for an exact fit, rectangles first if allowed, setting
+// *exactp if it is the exact fit plan.
+// With IEC16022_SMALLEST it is the smallest by area of the sizes flags
+// allow, then the one taking the fewest codewords, also trying the exact
+// fit plan (exmodes, if not null) encoded into binary in the sizes
+// between exlen and len, as once unlatched it may still fit.
+// returns the end of ecc200matrix (W 0) if none is big enough
+static struct ecc200matrix_s *
+ecc200size (int flags, int len, int exlen, char *exactp, unsigned char *binary, unsigned char *barcode, int barcodelen, const struct encmodes_s *exmodes, char *owned)
+{
+   struct ecc200matrix_s *matrix = ecc200matrix,
+      *best = 0;
+   int rect,
+     used = 0;
+   if (flags & IEC16022_SMALLEST)
+   {
+      for (; matrix->W; matrix++)
+      {
+         char x = matrix->bytes == exlen;
+         int u = x ? exlen : len;
+         if (!ecc200pickable (matrix, flags, ECC200RECT (matrix)) || (best && matrix->W * matrix->H > best->W * best->H))
+            continue;
+         if (!x && matrix->bytes < len)
+         {
+            if (!exmodes || matrix->bytes < exlen || !ecc200encode (binary, matrix->bytes, barcode, barcodelen, exmodes, &u, owned))
+               continue;
+            x = 1;
+         }
+         if (best && matrix->W * matrix->H == best->W * best->H && u >= used)
+            continue;
+         best = matrix;
+         used = u;
+         *exactp = x;
+      }
+      return best ? best : matrix;
+   }
+   for (rect = 1; rect >= 0; rect--)
+   {
+      for (matrix = ecc200matrix; matrix->W && (!ecc200pickable (matrix, flags, rect) || matrix->bytes != exlen); matrix++);
+      *exactp = 1;
+      if (matrix->W)
+         break;
+      // try for non exact fit
+      for (matrix = ecc200matrix; matrix->W && (!ecc200pickable (matrix, flags, rect) || matrix->bytes < len); matrix++);
+      *exactp = 0;
+      if (matrix->W)
+         break;
+   }
+   return matrix;
+}
+
+// Finds the first size flags allow that the encoding by modes fits, in
+// binary, rectangles first if allowed, or with IEC16022_SMALLEST the
+// smallest by area
+// returns the end of ecc200matrix (W 0) if none is big enough
+static struct ecc200matrix_s *
+ecc200fitsize (int flags, unsigned char *binary, unsigned char *barcode, int barcodelen, const struct encmodes_s *modes, char *owned)
+{
+   struct ecc200matrix_s *matrix = ecc200matrix,
+      *best = 0;
+   int rect;
+   if (flags & IEC16022_SMALLEST)
+   {
+      for (; matrix->W; matrix++)
+         if (ecc200pickable (matrix, flags, ECC200RECT (matrix)) && (!best || matrix->W * matrix->H < best->W * best->H)
+             && ecc200encode (binary, matrix->bytes, barcode, barcodelen, modes, 0, owned))
+            best = matrix;
+      return best ? best : matrix;
+   }
+   for (rect = 1; rect >= 0; rect--)
+   {
+      for (matrix = ecc200matrix; matrix->W; matrix++)
+         if (ecc200pickable (matrix, flags, rect) && ecc200encode (binary, matrix->bytes, barcode, barcodelen, modes, 0, owned))
+            break;
+      if (matrix->W)
+         break;
+   }
+   return matrix;
+}
+
+// Picks the size for barcode as planned by encplan, in enc, or ex for an
+// exact fit, as ecc200size does, setting modes to the plan taken, listed
+// in encoding if not null, and encoding it into binary, *usedp getting
+// the data codewords. A plan not encoding as planned falls back to the
+// not exact fit plan in whatever size it fits.
+// returns the end of ecc200matrix (W 0) if none is big enough
+static struct ecc200matrix_s *
+ecc200plansize (int flags, unsigned char *binary, unsigned char *barcode, int barcodelen, struct ecc200enc_s (*enc)[E_MAX], struct ecc200enc_s (*ex)[E_MAX], int len, int exlen, struct encmodes_s *modes, char *encoding, int *usedp, char *owned)
+{
+   struct ecc200matrix_s *matrix;
+   char exact;
+   encmodesplan (modes, ex, 1, barcodelen, 0); // for the sizes between with IEC16022_SMALLEST
+   if (!(matrix = ecc200size (flags, len, exlen, &exact, binary, barcode, barcodelen, modes, owned))->W)
+      return matrix;
+   encmodesplan (modes, exact ? ex : enc, exact, barcodelen, encoding);
+   if (ecc200encode (binary, matrix->bytes, barcode, barcodelen, modes, usedp, owned))
+      return matrix;
+   encmodesplan (modes, enc, 0, barcodelen, encoding);
+   if ((matrix = ecc200fitsize (flags, binary, barcode, barcodelen, modes, owned))->W)
+      ecc200encode (binary, matrix->bytes, barcode, barcodelen, modes, usedp, owned);
+   return matrix;
+}
+
+// The bytes s and t (sl and tl long) have in common at their ends
+static int
+enctail (const unsigned char *s, int sl, const unsigned char *t, int tl)
+{
+   int n = 0;
+   while (n < sl && n < tl && s[sl - 1 - n] == t[tl - 1 - n])
+      n++;
+   return n;
+}
+
+struct encbatch_s
+{
+   unsigned char *s;
+   int l,
+     i;                         // index given to iec16022ecc200plans
+};
+
+// Orders barcodes by their bytes from the end, so those with a tail in
+// common are next to each other, as in a trie of the reversed barcodes
+static int
+encbatchcmp (const void *a, const void *b)
+{
+   const struct encbatch_s *x = a,
+      *y = b;
+   int n = enctail (x->s, x->l, y->s, y->l);
+   if (n < x->l && n < y->l)
+      return x->s[x->l - 1 - n] - y->s[y->l - 1 - n];
+   return x->l - y->l;
+}
+
+// The work of iec16022ecc200plans, done under rb_ensure so that the
+// buffers are freed if it raises
+struct encplans_s
+{
+   int n,
+     m,                         // longest
+     flags;
+   const int *barcodelen;
+   unsigned char *const *barcode;
+   int *W,
+    *H;
+   char *const *encoding;
+   struct encbatch_s *b;
+   struct ecc200enc_s (*ws)[E_MAX];
+   short *tail;
+};
+
+static VALUE
+encplansrun (VALUE arg)
+{
+   struct encplans_s *p = (struct encplans_s *) arg;
+   unsigned char binary[4096];  // to check the plan fits
+   struct encmodes_s modes;
+   struct encbatch_s *b;
+   int i,
+     m = p->m;
+   const struct encbatch_s *last = 0;  // the last planned, whose rows are in ws
+   b = p->b = ALLOC_N (struct encbatch_s, p->n);
+   for (i = 0; i < p->n; i++)
+   {
+      b[i].s = p->barcode[i];
+      b[i].l = p->barcodelen[i];
+      b[i].i = i;
+   }
+   qsort (b, p->n, sizeof (*b), encbatchcmp);
+   // rows kept aligned at the end, so a tail has the same rows whatever comes before it
+   p->ws = (struct ecc200enc_s (*)[E_MAX]) ALLOC_N (char, 2 * (m + 1) * sizeof (*p->ws));
+   p->tail = ALLOC_N (short, m + 1);
+   for (i = 0; i < p->n; i++)
+   {
+      int l = b[i].l,
+        k = enckind (b[i].s, l),
+        len,
+        exlen;
+      struct ecc200enc_s (*enc)[E_MAX] = p->ws + m - l,
+         (*ex)[E_MAX] = p->ws + 2 * m + 1 - l;
+      struct ecc200matrix_s *matrix;
+      char exact;
+      if (k)
+      {                         // no need to plan
+         len = exlen = encsame (l, k, 0);
+         if ((matrix = ecc200size (p->flags, len, exlen, &exact, 0, 0, 0, 0, 0))->W)
+            encsame (l, k, p->encoding[b[i].i]);
+      } else
+      {                         // the list is written as the plan is checked to fit, as in iec16022ecc200into
+         int done = last ? enctail (b[i].s, l, last->s, last->l) : 0;
+         encplan (l, b[i].s, enc, ex, l - done, p->tail + m - l, &len, &exlen);
+         last = b + i;
+         matrix = ecc200plansize (p->flags, binary, b[i].s, l, enc, ex, len, exlen, &modes, p->encoding[b[i].i], 0, 0);
+      }
+      p->W[b[i].i] = matrix->W;
+      p->H[b[i].i] = matrix->H;
+   }
+   return Qnil;
+}
+
+static VALUE
+encplansfree (VALUE arg)
+{
+   struct encplans_s *p = (struct encplans_s *) arg;
+   free (p->tail);
+   free (p->ws);
+   free (p->b);
+   return Qnil;
+}
+
+void
+iec16022ecc200plans (int n, const int *barcodelen, unsigned char *const *barcode, int flags, int *W, int *H, char *const *encoding)
+{
+   struct encplans_s p = { n, 0, flags, barcodelen, barcode, W, H, encoding, 0, 0, 0 };
+   int i;
+   if (n <= 0)
+      return;
+   for (i = 0; i < n; i++)
+   {
+      if (barcodelen[i] > 1556)
+         rb_raise (rb_eRangeError, "barcode is too long (> 1556 chars)");
+      if (barcodelen[i] > p.m)
+         p.m = barcodelen[i];
+   }
+   rb_ensure (encplansrun, (VALUE) &p, encplansfree, (VALUE) &p);
 }
 
 void iec16022init(int *Wptr, int *Hptr, const char *barcode)
+{
+	iec16022initf(Wptr, Hptr, barcode, 0);
+}
+
+void iec16022initf(int *Wptr, int *Hptr, const char *barcode, int flags)
 {
 	if(Wptr == NULL || Hptr == NULL || barcode == NULL) return;
 	
 	int barcodelen = strlen(barcode) + 1;
 	struct ecc200matrix_s *matrix;
-	for (matrix = ecc200matrix; matrix->bytes < barcodelen; matrix++);
+	int rect;
+	for (rect = 1; rect >= 0; rect--) {
+		for (matrix = ecc200matrix; matrix->W && (!ecc200pickable(matrix, flags, rect) || matrix->bytes < barcodelen); matrix++);
+		if (matrix->W)
+			break;
+	}
 	*Wptr = matrix->W;
 	*Hptr = matrix->H;	
 }
 
-// Main encoding function
-// Returns the grid (malloced) containing the matrix. L corner at 0,0.
-// Takes suggested size in *Wptr, *Hptr, or 0,0. Fills in actual size.
-// Takes barcodelen and barcode to be encoded
-// Note, if *encodingptr is null, then fills with auto picked (malloced) encoding
-// If lenp not null, then the length of encoded data before any final unlatch or pad is stored
-// If maxp not null, then the max storage of this size code is stored
-// If eccp not null, then the number of ecc bytes used in this size is stored
-// Returns 0 on error (writes to stderr with details).
+// fill in the grid, one char per module, bottom row first
+static void
+ecc200grid (struct ecc200matrix_s *matrix, const unsigned char *binary, unsigned char *grid)
+{
+   const struct ecc200scatter_s *sc = ecc200scatter (matrix);
+   const unsigned short *to = ecc200scatterdata + sc->start;
+   int k;
+   memcpy (grid, ecc200templatedata + sc->tmpl, matrix->W * matrix->H);
+   for (k = 0; k < sc->codewords; k++, to += 8)
+   {                            // every module of each codeword, no tests
+      int c = binary[k];
+      grid[to[0]] = c & 1;
+      grid[to[1]] = (c >> 1) & 1;
+      grid[to[2]] = (c >> 2) & 1;
+      grid[to[3]] = (c >> 3) & 1;
+      grid[to[4]] = (c >> 4) & 1;
+      grid[to[5]] = (c >> 5) & 1;
+      grid[to[6]] = (c >> 6) & 1;
+      grid[to[7]] = c >> 7;
+   }
+}
+
+// fill in the grid bit packed, top row first, stride bytes per row
+static void
+ecc200packed (struct ecc200matrix_s *matrix, const unsigned char *binary, unsigned char *packed, int stride)
+{
+   const struct ecc200scatter_s *sc = ecc200scatter (matrix);
+   const unsigned short *to = ecc200packdata + sc->start;
+   int k;
+   memcpy (packed, ecc200packtemplatedata + sc->packtmpl, stride * matrix->H);
+   for (k = 0; k < sc->codewords; k++, to += 8)
+   {
+      int c = binary[k];
+      packed[to[0] >> 3] |= (c & 1) << (to[0] & 7);
+      packed[to[1] >> 3] |= ((c >> 1) & 1) << (to[1] & 7);
+      packed[to[2] >> 3] |= ((c >> 2) & 1) << (to[2] & 7);
+      packed[to[3] >> 3] |= ((c >> 3) & 1) << (to[3] & 7);
+      packed[to[4] >> 3] |= ((c >> 4) & 1) << (to[4] & 7);
+      packed[to[5] >> 3] |= ((c >> 5) & 1) << (to[5] & 7);
+      packed[to[6] >> 3] |= ((c >> 6) & 1) << (to[6] & 7);
+      packed[to[7] >> 3] |= (c >> 7) << (to[7] & 7);
+   }
+}
+
+int
+iec16022ecc200gridsize (int W, int H, int packed)
+{
+   if (!W)
+      W = H = 144;              // largest size
+   return packed ? (W + 63) / 64 * 8 * H : W * H;
+}
+
+// scratch holds the encoding, then the encplan workspace (plans for
+// exact and not exact fit), aligned
+#define ECC200WORKSPACE(l) (((l) + 1 + 7) & ~7)
+
+int
+iec16022ecc200scratchsize (int barcodelen)
+{
+   if (!barcodelen)
+      barcodelen = 1556;        // longest allowed
+   return ECC200WORKSPACE (barcodelen) + 2 * (barcodelen + 1) * E_MAX * sizeof (struct ecc200enc_s);
+}
+
 unsigned char *
-iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp)
+iec16022ecc200into (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp, int *stridep, int flags, unsigned char *grid, char *scratch, int *sparep)
 {
   // GS
   // max semacode size is 3116 (from iec16022ecc200.h)
@@ -807,10 +1460,16 @@ iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsign
   // to avoid any buffer overflow conditions.
    unsigned char binary[4096];  // encoded raw data and ecc to place in barcode
    int W = 0,
-      H = 0;
-   char *encoding = 0;
-   unsigned char *grid = 0;
-   struct ecc200matrix_s *matrix;
+      H = 0,
+      used;                     // data codewords, before any final unlatch
+   char *encoding = 0,
+      *owned = 0,               // encoding to free if raising an error
+      done = 0;                 // binary already encoded, checking it fits
+   struct encmodes_s modes;     // where the encoding's modes come from
+   int rows = !scratch && barcodelen >= 0 && barcodelen <= 1556 ? 2 * (barcodelen + 1) : 1;
+   struct ecc200enc_s own[rows][E_MAX],        // encplan workspace, if not in scratch
+    (*ws)[E_MAX] = own;
+   struct ecc200matrix_s *matrix = 0;
    
    // GS
    // using the length from the 144x144 semacode in the matrix
@@ -824,8 +1483,12 @@ iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsign
    }
    
    memset (binary, 0, sizeof (binary));
+   if (scratch)
+      ws = (struct ecc200enc_s (*)[E_MAX]) (scratch + ECC200WORKSPACE (barcodelen));
    if (encodingptr)
       encoding = *encodingptr;
+   if (!scratch)
+      owned = encoding;
    if (Wptr)
       W = *Wptr;
    if (Hptr)
@@ -840,99 +1503,97 @@ iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsign
          rb_raise(rb_eRangeError,  "invalid size for barcode");
          return 0;
       }
-      if (!encoding)
+   }
+   if (!encoding)
+   {                            // pick the encoding (and size) from one plan, for exact fit or not
+      int len,
+        exlen,
+        kind = enckind (barcode, barcodelen);
+      char exact;
+      struct ecc200enc_s (*ex)[E_MAX] = ws + barcodelen + 1,
+         (*plan)[E_MAX] = 0;
+      if (kind)
+         len = exlen = encsame (barcodelen, kind, 0);  // no need to plan
+      else
+         encplan (barcodelen, barcode, ws, ex, barcodelen, 0, &len, &exlen);
+      if (W)
       {
-         int len;
-         char *e = encmake (barcodelen, barcode, &len, 1);
-         if (e && len != matrix->bytes)
-         {                      // try not an exact fit
-            free (e);
-            e = encmake (barcodelen, barcode, &len, 0);
-            if (len > matrix->bytes)
-            {
-               free(e);
-               rb_raise(rb_eRangeError,  "cannot make barcode fit");
-               return 0;
-            }
+         if (exlen == matrix->bytes)
+            plan = ex;
+         else if (len <= matrix->bytes)
+            plan = ws;          // not an exact fit
+         else
+         {
+            rb_raise(rb_eRangeError,  "cannot make barcode fit");
+            return 0;
          }
-         encoding = e;
-      }
-   } else
-   {                            // find size
-      if (encoding)
-      {                         // find one that fits chosen encoding
-         for (matrix = ecc200matrix; matrix->W; matrix++)
-            if (ecc200encode (binary, matrix->bytes, barcode, barcodelen, encoding, 0))
-               break;
+      } else if (kind)
+      {
+         if ((matrix = ecc200size (flags, len, exlen, &exact, 0, 0, 0, 0, 0))->W)
+            plan = ws;
       } else
+      {                         // the list is only made if wanted, as the codewords are
+         if (encodingptr)
+            encoding = scratch ? scratch : (owned = ALLOC_N(char, barcodelen + 1));
+         done = (matrix = ecc200plansize (flags, binary, barcode, barcodelen, ws, ex, len, exlen, &modes, encoding, &used, owned))->W != 0;
+      }
+      if (plan)
       {
-         int len;
-         char *e;
-         e = encmake (barcodelen, barcode, &len, 1);
-         for (matrix = ecc200matrix; matrix->W && matrix->bytes != len; matrix++);
-         if (e && !matrix->W)
-         {                      // try for non exact fit
-            free (e);
-            e = encmake (barcodelen, barcode, &len, 0);
-            for (matrix = ecc200matrix; matrix->W && matrix->bytes < len; matrix++);
-         }
-         encoding = e;
+         if (kind || encodingptr)
+            encoding = scratch ? scratch : (owned = ALLOC_N(char, barcodelen + 1));
+         if (kind)
+         {
+            encsame (barcodelen, kind, encoding);
+            encmodeslist (&modes, encoding, barcodelen, owned);
+         } else
+            encmodesplan (&modes, plan, plan == ex, barcodelen, encoding);
       }
+   } else
+      encmodeslist (&modes, encoding, barcodelen, owned);
+   if (!W && !matrix)           // find size that fits chosen encoding
+      matrix = ecc200fitsize (flags, binary, barcode, barcodelen, &modes, owned);
+   if (!W)
+   {
       if (!matrix->W)
       {
-         free(encoding);
+         free(owned);
          rb_raise(rb_eRangeError,  "overlong barcode");
          return 0;
       }
       W = matrix->W;
       H = matrix->H;
    }
-   if (!ecc200encode (binary, matrix->bytes, barcode, barcodelen, encoding, lenp))
+   if (!done && !ecc200encode (binary, matrix->bytes, barcode, barcodelen, &modes, &used, owned))
    {
-      free(encoding);
+      free(owned);
       rb_raise(rb_eRangeError,  "barcode too long for expected encoding");
       return 0;
    }
+   if (lenp)
+      *lenp = used;
+   if (sparep)                  // the padding, which always starts 129
+      *sparep = matrix->bytes - used - (used < matrix->bytes && binary[used] != 129);
    // ecc code
-   ecc200 (binary, matrix->bytes, matrix->datablock, matrix->rsblock);
-   {                            // placement
-      int x,
-        y,
-        NC,
-        NR,
-       *places;
-      NC = W - 2 * (W / matrix->FW);
-      NR = H - 2 * (H / matrix->FH);
-      places = ALLOC_N(int, NC * NR);
-      ecc200placement (places, NR, NC);
-      grid = ALLOC_N(char, W * H);
-      memset (grid, 0, W * H);
-      for (y = 0; y < H; y += matrix->FH)
-      {
-         for (x = 0; x < W; x++)
-            grid[y * W + x] = 1;
-         for (x = 0; x < W; x += 2)
-            grid[(y + matrix->FH - 1) * W + x] = 1;
-      }
-      for (x = 0; x < W; x += matrix->FW)
-      {
-         for (y = 0; y < H; y++)
-            grid[y * W + x] = 1;
-         for (y = 0; y < H; y += 2)
-            grid[y * W + x + matrix->FW - 1] = 1;
-      }
-      for (y = 0; y < NR; y++)
-      {
-         for (x = 0; x < NC; x++)
-         {
-            int v = places[(NR - y - 1) * NC + x];
-            //rb_raise(rb_eRuntimeError,  "%4d", v);
-            if (v == 1 || v > 7 && (binary[(v >> 3) - 1] & (1 << (v & 7))))
-               grid[(1 + y + 2 * (y / (matrix->FH - 2))) * W + 1 + x + 2 * (x / (matrix->FW - 2))] = 1;
-         }
-         //rb_raise(rb_eRuntimeError,  "\n");
-      }
-      free (places);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+   if (matrix->bytes >= ECC200_NOGVL_BYTES)
+   {
+      struct ecc200_args a = { binary, matrix->bytes, matrix->datablock, matrix->rsblock };
+      rb_thread_call_without_gvl (ecc200_nogvl, &a, NULL, NULL);
+   } else
+#endif
+      ecc200 (binary, matrix->bytes, matrix->datablock, matrix->rsblock);
+   // placement
+   if (stridep)
+   {
+      *stridep = (W + 63) / 64 * 8;
+      if (!grid)
+         grid = ALLOC_N(unsigned char, *stridep * H);
+      ecc200packed (matrix, binary, grid, *stridep);
+   } else
+   {
+      if (!grid)
+         grid = ALLOC_N(unsigned char, W * H);
+      ecc200grid (matrix, binary, grid);
    }
    if (Wptr)
       *Wptr = W;
@@ -941,10 +1602,117 @@ iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsign
    if (encodingptr)
       *encodingptr = encoding;
    else
-      free(encoding); // get rid of this if we aren't returning it
+      free(owned); // get rid of this if we aren't returning it
    if (maxp)
       *maxp = matrix->bytes;
    if (eccp)
       *eccp = (matrix->bytes + 2) / matrix->datablock * matrix->rsblock;
    return grid;
 }
+
+// Main encoding function
+// Returns the grid (malloced) containing the matrix. L corner at 0,0.
+// Takes suggested size in *Wptr, *Hptr, or 0,0. Fills in actual size.
+// Takes barcodelen and barcode to be encoded
+// Note, if *encodingptr is null, then fills with auto picked (malloced) encoding
+// If lenp not null, then the length of encoded data before any final unlatch or pad is stored
+// If maxp not null, then the max storage of this size code is stored
+// If eccp not null, then the number of ecc bytes used in this size is stored
+// Returns 0 on error (writes to stderr with details).
+unsigned char *
+iec16022ecc200f (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp, int *stridep, int flags)
+{
+   return iec16022ecc200into (Wptr, Hptr, encodingptr, barcodelen, barcode, lenp, maxp, eccp, stridep, flags, 0, 0, 0);
+}
+
+unsigned char *
+iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp)
+{
+   return iec16022ecc200f (Wptr, Hptr, encodingptr, barcodelen, barcode, lenp, maxp, eccp, NULL, 0);
+}
+
+unsigned char *
+iec16022ecc200packed (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp, int *stridep)
+{
+   int stride;
+   return iec16022ecc200f (Wptr, Hptr, encodingptr, barcodelen, barcode, lenp, maxp, eccp, stridep ? stridep : &stride, 0);
+}
+
+#ifdef ECC200_TEST
+// The following checks that iec16022ecc200plans picks the same size and
+// encoding for each barcode as iec16022ecc200f does for it on its own,
+// for every combination of the size flags.
+// Build with:  ruby gentables.rb && cc -O2 -DECC200_TEST -I<ruby headers>
+//              -o ecc200 iec16022ecc200.c reedsol.c -lruby
+#define TESTN 400
+int
+main (void)
+{
+   static unsigned char buf[TESTN][400],
+    *barcode[TESTN];
+   static char enc[TESTN][401],
+    *encoding[TESTN];
+   static int len[TESTN],
+     W[TESTN],
+     H[TESTN];
+   int i,
+     j,
+     flags,
+     bad = 0;
+   ruby_init ();
+   srand (16022);
+   for (i = 0; i < TESTN; i++)
+   {
+      switch (i % 6)
+      {
+      case 0:                  // URLs sharing a tail
+         len[i] = sprintf ((char *) buf[i], "https://example.com/p/%d?src=label&v=%d", rand () % 100000, rand () % 3);
+         break;
+      case 1:                  // digits
+         len[i] = sprintf ((char *) buf[i], "%d%d", rand (), rand () % 1000);
+         break;
+      case 2:                  // C40, X12 and EDIFACT ranges
+         len[i] = 1 + rand () % 80;
+         for (j = 0; j < len[i]; j++)
+            buf[i][j] = "ABCDE 12.:/*>\r"[rand () % 14];
+         break;
+      case 3:                  // printable
+         len[i] = 1 + rand () % 60;
+         for (j = 0; j < len[i]; j++)
+            buf[i][j] = 32 + rand () % 95;
+         break;
+      case 4:                  // high bytes
+         len[i] = 1 + rand () % 40;
+         for (j = 0; j < len[i]; j++)
+            buf[i][j] = 128 + rand () % 128;
+         break;
+      default:                 // long, of a few letters
+         len[i] = 1 + rand () % 400;
+         for (j = 0; j < len[i]; j++)
+            buf[i][j] = 'a' + rand () % 3;
+      }
+      barcode[i] = buf[i];
+      encoding[i] = enc[i];
+   }
+   for (flags = 0; flags < 8; flags++)
+   {
+      iec16022ecc200plans (TESTN, len, barcode, flags, W, H, encoding);
+      for (i = 0; i < TESTN; i++)
+      {
+         int w = 0,
+            h = 0;
+         char *e = 0;
+         unsigned char *grid = iec16022ecc200f (&w, &h, &e, len[i], barcode[i], 0, 0, 0, 0, flags);
+         if (w != W[i] || h != H[i] || strcmp (e, encoding[i]))
+         {
+            if (bad++ < 10)
+               printf ("flags %d barcode %d: %dx%d %s, planned %dx%d %s\n", flags, i, w, h, e, W[i], H[i], encoding[i]);
+         }
+         free (grid);
+         free (e);
+      }
+   }
+   printf ("%d of %d differ\n", bad, 8 * TESTN);
+   return bad != 0;
+}
+#endif
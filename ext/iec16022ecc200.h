@@ -8,6 +8,22 @@
 // Added exact size checking shortcodes on encoding generation for iec16022
 //
 
+// Size selection flags for iec16022ecc200f
+#define IEC16022_RECT 1         // pick rectangular sizes (8x18 to 16x48) when they fit
+#define IEC16022_DMRE 2         // with IEC16022_RECT, the DMRE rectangles (8x48 to 26x64) too
+#define IEC16022_SMALLEST 4     // pick the smallest size by area, not rectangles first
+// Limits on the longer side of the size picked, in modules (1 to 144),
+// or'ed in with the flags above
+#define IEC16022_MINSIDE(n) ((n) << 8)
+#define IEC16022_MAXSIDE(n) ((n) << 16)
+
+// Picks an initial size for barcode, for the main encoding function
+// (in *Wptr, *Hptr - 0 if none is big enough)
+void
+iec16022init (int *Wptr, int *Hptr, const char *barcode);
+void
+iec16022initf (int *Wptr, int *Hptr, const char *barcode, int flags);
+
 // Main encoding function
 // Returns the grid (malloced) containing the matrix. L corner at 0,0.
 // Takes suggested size in *Wptr, *Hptr, or 0,0. Fills in actual size.
@@ -23,5 +39,87 @@
 unsigned char *
 iec16022ecc200 (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp,int *maxp,int *eccp);
 
+// As iec16022ecc200, but the grid returned is bit packed: rows top
+// down, the leftmost module in the top bit of the first byte, and each
+// row padded to a multiple of 64 bits. The bytes per row are stored in
+// *stridep, if not null.
+unsigned char *
+iec16022ecc200packed (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp, int *stridep);
+
+// As iec16022ecc200 (stridep null) or iec16022ecc200packed (stridep not
+// null), with size selection flags. Only square sizes are picked unless
+// IEC16022_RECT is given, in which case a rectangle is picked if one fits
+// (counting the DMRE sizes only if IEC16022_DMRE is given too).
+unsigned char *
+iec16022ecc200f (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp, int *stridep, int flags);
+
+// As iec16022ecc200f, but without any malloc: the grid is written to
+// grid and an auto picked encoding to scratch, which *encodingptr then
+// points into. Either may be null to have it malloced as before.
+// An auto picked encoding is only listed if encodingptr is not null,
+// the codewords being made straight from the plan it is picked from.
+// If sparep is not null, the data codewords left over as padding, that
+// more data could take without a bigger size, are stored.
+// With IEC16022_SMALLEST in flags, the size picked is the smallest by
+// area that either plan fits, trying the plan for an exact fit in sizes
+// it only fits once unlatched too, then the one using fewest codewords.
+// Returns grid.
+unsigned char *
+iec16022ecc200into (int *Wptr, int *Hptr, char **encodingptr, int barcodelen, unsigned char *barcode, int *lenp, int *maxp, int *eccp, int *stridep, int flags, unsigned char *grid, char *scratch, int *sparep);
+
+// The bytes needed for the grid given to iec16022ecc200into for a WxH
+// symbol, packed or not, or for the largest symbol if W is 0
+int
+iec16022ecc200gridsize (int W, int H, int packed);
+
+// The bytes needed for the scratch given to iec16022ecc200into to
+// encode barcodelen bytes, or the longest barcode if barcodelen is 0.
+// Besides the encoding, it holds the workspace for picking it, so
+// reusing one scratch saves clearing a worst case one on the stack.
+int
+iec16022ecc200scratchsize (int barcodelen);
+
+// Picks the size and encoding of each of n barcodes, as iec16022ecc200f
+// would given 0x0 and no encoding, but planning them together so that
+// the work for a tail several have in common is only done once. Sorting
+// them by their bytes from the end puts those sharing a tail together.
+// W[i] and H[i] get the size (0 if none is big enough) and encoding[i]
+// (barcodelen[i] + 1 bytes) the encoding, to give iec16022ecc200into.
+void
+iec16022ecc200plans (int n, const int *barcodelen, unsigned char *const *barcode, int flags, int *W, int *H, char *const *encoding);
+
+
+
+// Appends the ecc codewords to each of n buffers holding the data
+// codewords for a WxH symbol, all n being coded together.
+// Each buffer must have room for the whole symbol's codewords.
+// Returns 0 if WxH is not an ECC200 size.
+int
+iec16022ecc200batch (int W, int H, int n, unsigned char *const *binary);
+
+// Checks the ecc of the len codewords (data then ecc, as placed in
+// the symbol) of a WxH symbol, without correcting anything.
+// Returns 1 if valid, 0 if not, -1 if WxH is not an ECC200 size or
+// len is not its number of codewords.
+int
+iec16022ecc200check (int W, int H, int len, const unsigned char *binary);
+
+// Reads the codewords back out of a WxH grid (as returned by
+// iec16022ecc200) into binary, which needs room for all of them.
+// Returns the number of codewords, 0 if WxH is not an ECC200 size.
+int
+iec16022ecc200codewords (int W, int H, const unsigned char *grid, unsigned char *binary);
 
+// Corrects the len codewords of a WxH symbol in place, erase listing
+// nerase codeword indexes known to be bad (nerase may be 0).
+// Returns the number of codewords corrected, -1 if they are beyond
+// correction, -2 if WxH is not an ECC200 size or len is not its
+// number of codewords.
+int
+iec16022ecc200correct (int W, int H, int len, unsigned char *binary, int nerase, const int *erase);
 
+// Decodes the data codewords of a WxH symbol back to its message,
+// which needs room for twice the data codewords plus 9.
+// Returns the message length, -1 if the codewords do not decode.
+int
+iec16022ecc200decode (int W, int H, const unsigned char *binary, unsigned char *message);
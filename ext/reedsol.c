@@ -1,40 +1,58 @@
 // reedsol.c
 //
-// This is a simple Reed-Solomon encoder
+// Reed-Solomon encoder and decoder for ECC200 and other GF(2**m) codes
 // (C) Cliff Hones 2004
 //
-// It is not written with high efficiency in mind, so is probably
-// not suitable for real-time encoding.  The aim was to keep it
-// simple, general and clear.
-//
-// <Some notes on the theory and implementation need to be added here>
-
 // Usage:
-// First call rs_init_gf(poly) to set up the Galois Field parameters.
-// Then  call rs_init_code(size, index) to set the encoding size
-// Then  call rs_encode(datasize, data, out) to encode the data.
+// All state lives in an rs_codec (see reedsol.h), zeroed before use.
+// rs_codec_init_gf(rs, poly) sets up the Galois Field, then
+// rs_codec_init_code(rs, nsym, index) the generator polynomial, which
+// must follow any rs_codec_init_gf.  Once set up a codec is only read,
+// so threads may share it:
+//   rs_codec_encode        nsym check symbols for one message
+//   rs_codec_encode_lanes  several messages interleaved byte by byte,
+//                          as ECC200 lays out its blocks
+//   rs_codec_encode_batch  several messages in separate buffers
+//   rs_codec_syndromes, rs_codec_check and rs_codec_decode
+//                          check a codeword and correct errors and
+//                          erasures in it
+// rs_codec_free releases whatever init malloced.
+//
+// rs_init_gf, rs_init_code and rs_encode are the original interface,
+// kept as wrappers around one static codec, so only one caller may use
+// them at a time.
 //
-// These can be called repeatedly as required - but note that
-// rs_init_code must be called following any rs_init_gf call.
+// Tables: the log/antilog tables for the ECC200 field (poly 0x12d) and
+// its generator polynomials for every block size are generated at build
+// time (see gentables.rb), so setting up an ECC200 codec is a lookup
+// with no malloc.  Other fields and codes have their tables built and
+// malloced at run time.
 //
-// If the parameters are fixed, some of the statics below can be
-// replaced with constants in the obvious way, and additionally
-// malloc/free can be avoided by using static arrays of a suitable
-// size.
+// Kernels: each encoder picks one when called.  Codes that are not
+// prebuilt divide by the generator in logs.  For prebuilt codes every
+// generator coefficient has a 256-entry row of a product table, so the
+// inner loop is a lookup and an XOR.  On x86 with SSSE3 or AVX2,
+// detected at run time so one build runs anywhere, codes of up to
+// RS_SIMDMAX check symbols are updated a vector at a time with split
+// nibble PSHUFB lookups, and the lane encoders carry up to 16 or 32
+// messages in one vector.
 
 #include <stdio.h>              // only needed for debug (main)
 #include <stdlib.h>             // only needed for malloc/free
+#include <string.h>
+#include <time.h>               // only needed for debug (main)
+#include "reedsol.h"
+#include "rstables.h"           // generated by gentables.rb
 
-static int gfpoly;
-static int symsize;             // in bits
-static int logmod;              // 2**symsize - 1
-static int rlen;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RS_SIMD                 // SSSE3/AVX2 encoders, picked at run time
+#include <immintrin.h>
+#define RS_SIMDMAX 96           // largest rlen handled, a multiple of 32
+#endif
 
-static int *log = NULL,
-   *alog = NULL,
-   *rspoly = NULL;
+static rs_codec rs_static;      // used by rs_init_gf, rs_init_code, rs_encode
 
-// rs_init_gf(poly) initialises the parameters for the Galois Field.
+// rs_codec_init_gf(rs, poly) initialises the parameters for the Galois Field.
 // The symbol size is determined from the highest bit set in poly
 // This implementation will support sizes up to 30 bits (though that
 // will result in very large log/antilog tables) - bit sizes of
@@ -45,45 +63,82 @@ static int *log = NULL,
 // a**8 + a**5 + a**3 + a**2 + 1, which translates to 0x12d.
 
 void
-rs_init_gf (int poly)
+rs_codec_init_gf (rs_codec * rs, int poly)
 {
    int m,
      b,
      p,
      v;
+   int *l,
+    *a;
 
    // Return storage from previous setup
-   if (log)
-   {
-      free (log);
-      free (alog);
-      free (rspoly);
-      rspoly = NULL;
-   }
+   rs_codec_free (rs);
    // Find the top bit, and hence the symbol size
    for (b = 1, m = 0; b <= poly; b <<= 1)
       m++;
    b >>= 1;
    m--;
-   gfpoly = poly;
-   symsize = m;
+   rs->gfpoly = poly;
+   rs->symsize = m;
+
+   rs->logmod = (1 << m) - 1;
 
+   // ECC200 uses prebuilt tables
+   if (poly == 0x12d)
+   {
+      rs->log = rs_log12d;
+      rs->alog = rs_alog12d;
+      return;
+   }
    // Calculate the log/alog tables
-   logmod = (1 << m) - 1;
-   log = (int *) malloc (sizeof (int) * (logmod + 1));
-   alog = (int *) malloc (sizeof (int) * logmod);
+   rs->logbuf = (int *) malloc (sizeof (int) * (2 * rs->logmod + 1));
+   l = rs->logbuf;
+   a = rs->logbuf + rs->logmod + 1;
 
-   for (p = 1, v = 0; v < logmod; v++)
+   for (p = 1, v = 0; v < rs->logmod; v++)
    {
-      alog[v] = p;
-      log[p] = v;
+      a[v] = p;
+      l[p] = v;
       p <<= 1;
       if (p & b)
          p ^= poly;
    }
+   rs->log = l;
+   rs->alog = a;
 }
 
-// rs_init_code(nsym, index) initialises the Reed-Solomon encoder
+// rs_make_poly(nsym, index) builds the RS generator polynomial
+// (x + 2**i)*(x + 2**(i+1))*...   [nsym terms]  with i = index,
+// low order coefficient first, in a malloced array of nsym+1 ints.
+
+static int *
+rs_make_poly (const rs_codec * rs, int nsym, int index)
+{
+   const int *log = rs->log,
+      *alog = rs->alog;
+   int logmod = rs->logmod;
+   int i,
+     k;
+   int *poly = (int *) malloc (sizeof (int) * (nsym + 1));
+
+   poly[0] = 1;
+   for (i = 1; i <= nsym; i++)
+   {
+      poly[i] = 1;
+      for (k = i - 1; k > 0; k--)
+      {
+         if (poly[k])
+            poly[k] = alog[(log[poly[k]] + index) % logmod];
+         poly[k] ^= poly[k - 1];
+      }
+      poly[0] = alog[(log[poly[0]] + index) % logmod];
+      index++;
+   }
+   return poly;
+}
+
+// rs_codec_init_code(rs, nsym, index) initialises the Reed-Solomon encoder
 // nsym is the number of symbols to be generated (to be appended
 // to the input data).  index is usually 1 - it is the index of
 // the constant in the first term (i) of the RS generator polynomial:
@@ -91,39 +146,47 @@ rs_init_gf (int poly)
 // For ECC200, index is 1.
 
 void
-rs_init_code (int nsym, int index)
+rs_codec_init_code (rs_codec * rs, int nsym, int index)
 {
-   int i,
-     k;
+   int k;
 
-   if (rspoly)
-      free (rspoly);
-   rspoly = (int *) malloc (sizeof (int) * (nsym + 1));
+   if (rs->polybuf)
+   {
+      free (rs->polybuf);
+      rs->polybuf = NULL;
+   }
 
-   rlen = nsym;
+   rs->rlen = nsym;
+   rs->index = index;
+   rs->mul[0] = NULL;
 
-   rspoly[0] = 1;
-   for (i = 1; i <= nsym; i++)
+   // ECC200 uses prebuilt generator polynomials
+   if (rs->gfpoly == 0x12d && index == 1 && nsym <= RS_MAXNSYM12D)
    {
-      rspoly[i] = 1;
-      for (k = i - 1; k > 0; k--)
-      {
-         if (rspoly[k])
-            rspoly[k] = alog[(log[rspoly[k]] + index) % logmod];
-         rspoly[k] ^= rspoly[k - 1];
-      }
-      rspoly[0] = alog[(log[rspoly[0]] + index) % logmod];
-      index++;
+      rs->rspoly = rs_poly12d + rs_poly12d_start[nsym];
+      // and the product table row for each coefficient
+      for (k = 0; k <= nsym; k++)
+         rs->mul[k] = rs_mul12d[rs->rspoly[k]];
+      return;
    }
+   rs->polybuf = rs_make_poly (rs, nsym, index);
+   rs->rspoly = rs->polybuf;
 }
 
+// General encoder, using log/alog arithmetic
+//
 // Note that the following uses byte arrays, so is only suitable for
 // symbol sizes up to 8 bits.  Just change the data type of data and res
 // to unsigned int * for larger symbols.
 
-void
-rs_encode (int len, unsigned char *data, unsigned char *res)
+static void
+rs_encode_log (const rs_codec * rs, int len, unsigned char *data, unsigned char *res)
 {
+   const int *log = rs->log,
+      *alog = rs->alog,
+      *rspoly = rs->rspoly;
+   int logmod = rs->logmod,
+      rlen = rs->rlen;
    int i,
      k,
      m;
@@ -146,8 +209,776 @@ rs_encode (int len, unsigned char *data, unsigned char *res)
    }
 }
 
-#ifndef LIB
-// The following tests the routines with the ISO/IEC 16022 Annexe R data
+// Table driven encoder for prebuilt codes: mul[k][m] is rspoly[k] * m,
+// and mul[k][0] is 0, so no test is needed for zero terms.
+
+static void
+rs_encode_mul (const rs_codec * rs, int len, unsigned char *data, unsigned char *res)
+{
+   const unsigned char *const *mul = rs->mul;
+   int rlen = rs->rlen;
+   int i,
+     k,
+     m;
+   for (i = 0; i < rlen; i++)
+      res[i] = 0;
+   for (i = 0; i < len; i++)
+   {
+      m = res[rlen - 1] ^ data[i];
+      for (k = rlen - 1; k > 0; k--)
+         res[k] = res[k - 1] ^ mul[k][m];
+      res[0] = mul[0][m];
+   }
+}
+
+#ifdef RS_SIMD
+// SIMD encoders for prebuilt codes.
+//
+// These keep the check symbols top first, r[j] = res[rlen - 1 - j], so
+// each data byte shifts the whole register down one byte:
+//    m = r[0] ^ data,  r[j] = r[j + 1] ^ g[j] * m
+// with g[j] = rspoly[rlen - 1 - j].  g * m is done 16 bytes at a time
+// with two PSHUFB lookups in m's split nibble product tables, indexed
+// by the low and high nibbles of g.  The register lives in nc vectors,
+// and nc is a constant in each inlined copy so they stay in registers.
+
+// SIMD available: 0 none, 1 SSSE3, 2 AVX2
+static int
+rs_simd_level (void)
+{
+   static int cached = -1;      // atomic, ecc200 encodes without the GVL
+   int level = __atomic_load_n (&cached, __ATOMIC_RELAXED);
+   if (level < 0)
+   {                            // racing threads all store the same value
+      __builtin_cpu_init ();
+      level = __builtin_cpu_supports ("avx2") ? 2 : __builtin_cpu_supports ("ssse3") ? 1 : 0;
+      __atomic_store_n (&cached, level, __ATOMIC_RELAXED);
+   }
+   return level;
+}
+
+// split the reversed generator into low and high nibbles, zero padded
+static void
+rs_simd_gen (const rs_codec * rs, unsigned char *glo, unsigned char *ghi)
+{
+   int j;
+   for (j = 0; j < RS_SIMDMAX; j++)
+   {
+      int g = j < rs->rlen ? rs->rspoly[rs->rlen - 1 - j] : 0;
+      glo[j] = g & 15;
+      ghi[j] = g >> 4;
+   }
+}
+
+static inline __attribute__ ((target ("ssse3"), always_inline)) void
+rs_encode_ssse3_nc (const int nc, const unsigned char *glo, const unsigned char *ghi, int len, const unsigned char *data, unsigned char *r)
+{
+   __m128i v[RS_SIMDMAX / 16],
+     gl[RS_SIMDMAX / 16],
+     gh[RS_SIMDMAX / 16];
+   int i,
+     j;
+   for (j = 0; j < nc; j++)
+   {
+      v[j] = _mm_setzero_si128 ();
+      gl[j] = _mm_loadu_si128 ((const __m128i *) (glo + 16 * j));
+      gh[j] = _mm_loadu_si128 ((const __m128i *) (ghi + 16 * j));
+   }
+   for (i = 0; i < len; i++)
+   {
+      int m = (_mm_cvtsi128_si32 (v[0]) ^ data[i]) & 0xFF;
+      __m128i tl = _mm_loadu_si128 ((const __m128i *) rs_nib12d[m][0]),
+         th = _mm_loadu_si128 ((const __m128i *) rs_nib12d[m][1]);
+      for (j = 0; j < nc; j++)
+      {
+         __m128i next = j + 1 < nc ? _mm_alignr_epi8 (v[j + 1], v[j], 1) : _mm_srli_si128 (v[j], 1);
+         v[j] = _mm_xor_si128 (next, _mm_xor_si128 (_mm_shuffle_epi8 (tl, gl[j]), _mm_shuffle_epi8 (th, gh[j])));
+      }
+   }
+   for (j = 0; j < nc; j++)
+      _mm_storeu_si128 ((__m128i *) (r + 16 * j), v[j]);
+}
+
+static __attribute__ ((target ("ssse3"))) void
+rs_encode_ssse3 (const rs_codec * rs, int len, unsigned char *data, unsigned char *res)
+{
+   unsigned char glo[RS_SIMDMAX],
+     ghi[RS_SIMDMAX],
+     r[RS_SIMDMAX];
+   int k;
+   rs_simd_gen (rs, glo, ghi);
+   switch ((rs->rlen + 15) / 16)
+   {
+   case 1:
+      rs_encode_ssse3_nc (1, glo, ghi, len, data, r);
+      break;
+   case 2:
+      rs_encode_ssse3_nc (2, glo, ghi, len, data, r);
+      break;
+   case 3:
+      rs_encode_ssse3_nc (3, glo, ghi, len, data, r);
+      break;
+   case 4:
+      rs_encode_ssse3_nc (4, glo, ghi, len, data, r);
+      break;
+   case 5:
+      rs_encode_ssse3_nc (5, glo, ghi, len, data, r);
+      break;
+   default:
+      rs_encode_ssse3_nc (6, glo, ghi, len, data, r);
+   }
+   for (k = 0; k < rs->rlen; k++)
+      res[k] = r[rs->rlen - 1 - k];
+}
+
+// AVX2 does the same 32 bytes at a time.  PSHUFB works within 128 bit
+// lanes, so the nibble tables are broadcast to both, and the one byte
+// shift across the lanes needs a permute before the align.
+static inline __attribute__ ((target ("avx2"), always_inline)) void
+rs_encode_avx2_nc (const int nc, const unsigned char *glo, const unsigned char *ghi, int len, const unsigned char *data, unsigned char *r)
+{
+   __m256i v[RS_SIMDMAX / 32],
+     gl[RS_SIMDMAX / 32],
+     gh[RS_SIMDMAX / 32];
+   int i,
+     j;
+   for (j = 0; j < nc; j++)
+   {
+      v[j] = _mm256_setzero_si256 ();
+      gl[j] = _mm256_loadu_si256 ((const __m256i *) (glo + 32 * j));
+      gh[j] = _mm256_loadu_si256 ((const __m256i *) (ghi + 32 * j));
+   }
+   for (i = 0; i < len; i++)
+   {
+      int m = (_mm256_cvtsi256_si32 (v[0]) ^ data[i]) & 0xFF;
+      __m256i tl = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) rs_nib12d[m][0])),
+         th = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) rs_nib12d[m][1]));
+      for (j = 0; j < nc; j++)
+      {
+         __m256i hi = _mm256_permute2x128_si256 (v[j], j + 1 < nc ? v[j + 1] : _mm256_setzero_si256 (), 0x21);
+         __m256i next = _mm256_alignr_epi8 (hi, v[j], 1);
+         v[j] = _mm256_xor_si256 (next, _mm256_xor_si256 (_mm256_shuffle_epi8 (tl, gl[j]), _mm256_shuffle_epi8 (th, gh[j])));
+      }
+   }
+   for (j = 0; j < nc; j++)
+      _mm256_storeu_si256 ((__m256i *) (r + 32 * j), v[j]);
+}
+
+static __attribute__ ((target ("avx2"))) void
+rs_encode_avx2 (const rs_codec * rs, int len, unsigned char *data, unsigned char *res)
+{
+   unsigned char glo[RS_SIMDMAX],
+     ghi[RS_SIMDMAX],
+     r[RS_SIMDMAX];
+   int k;
+   rs_simd_gen (rs, glo, ghi);
+   switch ((rs->rlen + 31) / 32)
+   {
+   case 1:
+      rs_encode_avx2_nc (1, glo, ghi, len, data, r);
+      break;
+   case 2:
+      rs_encode_avx2_nc (2, glo, ghi, len, data, r);
+      break;
+   default:
+      rs_encode_avx2_nc (3, glo, ghi, len, data, r);
+   }
+   for (k = 0; k < rs->rlen; k++)
+      res[k] = r[rs->rlen - 1 - k];
+}
+#endif
+
+// rs_codec_encode(rs, len, data, res) calculates the nsym check symbols
+// for len bytes of data into res - note they come back reversed.
+// The codec is only read, so one set up codec can be shared.
+
+void
+rs_codec_encode (const rs_codec * rs, int len, unsigned char *data, unsigned char *res)
+{
+   if (!rs->mul[0])
+      rs_encode_log (rs, len, data, res);
+#ifdef RS_SIMD
+   else if (rs->rlen <= RS_SIMDMAX && rs_simd_level () >= 2)
+      rs_encode_avx2 (rs, len, data, res);
+   else if (rs->rlen <= RS_SIMDMAX && rs_simd_level () >= 1)
+      rs_encode_ssse3 (rs, len, data, res);
+#endif
+   else
+      rs_encode_mul (rs, len, data, res);
+}
+
+// Interleaved encoding: several messages ("lanes") side by side, as
+// ECC200 lays out its interleaved blocks.  Byte i of lane l is at
+// data[i * stride + l].  Lanes below nlong have len bytes, the rest
+// len - 1 (so the last row only holds the long lanes).  Check symbol j,
+// highest order first (i.e. not reversed), of lane l goes to
+// res[j * rstride + l].
+
+// the data bytes of every lane for step i - short lanes are fed a
+// leading zero, which leaves their (zero) check symbols unchanged
+static void
+rs_lanes_row (unsigned char *d, int lanes, int i, int nlong, const unsigned char *data, int stride)
+{
+   memcpy (d, data + i * stride, nlong);
+   if (i)
+      memcpy (d + nlong, data + (i - 1) * stride + nlong, lanes - nlong);
+   else
+      memset (d + nlong, 0, lanes - nlong);
+}
+
+static void
+rs_encode_lanes_scalar (const rs_codec * rs, int lanes, int len, int nlong, const unsigned char *data, int stride, unsigned char *res, int rstride)
+{
+   unsigned char buf[256],
+     ecc[256];
+   int l,
+     n,
+     p;
+   for (l = 0; l < lanes; l++)
+   {
+      p = 0;
+      for (n = 0; n < (l < nlong ? len : len - 1); n++)
+         buf[p++] = data[n * stride + l];
+      rs_codec_encode (rs, p, buf, ecc);
+      for (n = 0; n < rs->rlen; n++)
+         res[n * rstride + l] = ecc[rs->rlen - 1 - n];
+   }
+}
+
+#ifdef RS_SIMD
+// SIMD interleaved encoders, one lane per byte of the vector.
+//
+// Each check symbol position k is one vector s[], holding that symbol
+// for every lane, and the feedback bytes m of all lanes are multiplied
+// by the constant rspoly[k] with PSHUFB lookups in rspoly[k]'s nibble
+// tables, indexed by m's low and high nibbles.  Instead of moving every
+// vector down one place per step the vectors are used as a ring: with
+// the top symbol in slot t, symbol k is in slot (t + 1 + k) % nsym.
+
+static __attribute__ ((target ("ssse3"))) void
+rs_encode_lanes_ssse3 (const rs_codec * rs, int lanes, int len, int nlong, const unsigned char *data, int stride, unsigned char *res, int rstride)
+{
+   __m128i s[RS_MAXNSYM12D],
+     tl[RS_MAXNSYM12D + 1],
+     th[RS_MAXNSYM12D + 1];
+   const __m128i lomask = _mm_set1_epi8 (0x0F);
+   unsigned char d[16];
+   int nsym = rs->rlen,
+      t = nsym - 1,
+      i,
+      k;
+   for (k = 0; k <= nsym; k++)
+   {
+      tl[k] = _mm_loadu_si128 ((const __m128i *) rs_nib12d[rs->rspoly[k]][0]);
+      th[k] = _mm_loadu_si128 ((const __m128i *) rs_nib12d[rs->rspoly[k]][1]);
+   }
+   for (k = 0; k < nsym; k++)
+      s[k] = _mm_setzero_si128 ();
+   memset (d, 0, sizeof (d));
+   for (i = 0; i < len; i++)
+   {
+      __m128i m,
+        ml,
+        mh;
+      rs_lanes_row (d, lanes, i, nlong, data, stride);
+      m = _mm_xor_si128 (s[t], _mm_loadu_si128 ((const __m128i *) d));
+      ml = _mm_and_si128 (m, lomask);
+      mh = _mm_and_si128 (_mm_srli_epi16 (m, 4), lomask);
+      // symbol k-1 becomes symbol k in place
+      for (k = 1; t + k < nsym; k++)
+         s[t + k] = _mm_xor_si128 (s[t + k], _mm_xor_si128 (_mm_shuffle_epi8 (tl[k], ml), _mm_shuffle_epi8 (th[k], mh)));
+      for (; k < nsym; k++)
+         s[t + k - nsym] = _mm_xor_si128 (s[t + k - nsym], _mm_xor_si128 (_mm_shuffle_epi8 (tl[k], ml), _mm_shuffle_epi8 (th[k], mh)));
+      s[t] = _mm_xor_si128 (_mm_shuffle_epi8 (tl[0], ml), _mm_shuffle_epi8 (th[0], mh));
+      t = t ? t - 1 : nsym - 1;
+   }
+   for (k = 0; k < nsym; k++)
+   {
+      _mm_storeu_si128 ((__m128i *) d, s[(t + 1 + k) % nsym]);
+      memcpy (res + (nsym - 1 - k) * rstride, d, lanes);
+   }
+}
+
+static __attribute__ ((target ("avx2"))) void
+rs_encode_lanes_avx2 (const rs_codec * rs, int lanes, int len, int nlong, const unsigned char *data, int stride, unsigned char *res, int rstride)
+{
+   __m256i s[RS_MAXNSYM12D],
+     tl[RS_MAXNSYM12D + 1],
+     th[RS_MAXNSYM12D + 1];
+   const __m256i lomask = _mm256_set1_epi8 (0x0F);
+   unsigned char d[32];
+   int nsym = rs->rlen,
+      t = nsym - 1,
+      i,
+      k;
+   for (k = 0; k <= nsym; k++)
+   {
+      tl[k] = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) rs_nib12d[rs->rspoly[k]][0]));
+      th[k] = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) rs_nib12d[rs->rspoly[k]][1]));
+   }
+   for (k = 0; k < nsym; k++)
+      s[k] = _mm256_setzero_si256 ();
+   memset (d, 0, sizeof (d));
+   for (i = 0; i < len; i++)
+   {
+      __m256i m,
+        ml,
+        mh;
+      rs_lanes_row (d, lanes, i, nlong, data, stride);
+      m = _mm256_xor_si256 (s[t], _mm256_loadu_si256 ((const __m256i *) d));
+      ml = _mm256_and_si256 (m, lomask);
+      mh = _mm256_and_si256 (_mm256_srli_epi16 (m, 4), lomask);
+      for (k = 1; t + k < nsym; k++)
+         s[t + k] = _mm256_xor_si256 (s[t + k], _mm256_xor_si256 (_mm256_shuffle_epi8 (tl[k], ml), _mm256_shuffle_epi8 (th[k], mh)));
+      for (; k < nsym; k++)
+         s[t + k - nsym] = _mm256_xor_si256 (s[t + k - nsym], _mm256_xor_si256 (_mm256_shuffle_epi8 (tl[k], ml), _mm256_shuffle_epi8 (th[k], mh)));
+      s[t] = _mm256_xor_si256 (_mm256_shuffle_epi8 (tl[0], ml), _mm256_shuffle_epi8 (th[0], mh));
+      t = t ? t - 1 : nsym - 1;
+   }
+   for (k = 0; k < nsym; k++)
+   {
+      _mm256_storeu_si256 ((__m256i *) d, s[(t + 1 + k) % nsym]);
+      memcpy (res + (nsym - 1 - k) * rstride, d, lanes);
+   }
+}
+#endif
+
+// rs_codec_encode_lanes(rs, lanes, len, nlong, data, stride, res, rstride)
+// encodes interleaved messages as described above, up to 32 lanes at a
+// time with SIMD where available.
+
+void
+rs_codec_encode_lanes (const rs_codec * rs, int lanes, int len, int nlong, const unsigned char *data, int stride, unsigned char *res, int rstride)
+{
+   while (lanes > 0)
+   {
+      int n = lanes,
+         nl = nlong;
+#ifdef RS_SIMD
+      if (rs->mul[0] && rs_simd_level () >= 1)
+      {
+         if (n > 16 && rs_simd_level () >= 2)
+         {
+            if (n > 32)
+               n = 32;
+            if (nl > n)
+               nl = n;
+            rs_encode_lanes_avx2 (rs, n, len, nl, data, stride, res, rstride);
+         } else
+         {
+            if (n > 16)
+               n = 16;
+            if (nl > n)
+               nl = n;
+            rs_encode_lanes_ssse3 (rs, n, len, nl, data, stride, res, rstride);
+         }
+      } else
+#endif
+         rs_encode_lanes_scalar (rs, n, len, nl, data, stride, res, rstride);
+      data += n;
+      res += n;
+      lanes -= n;
+      nlong = nlong > n ? nlong - n : 0;
+   }
+}
+
+// rs_codec_encode_batch(rs, n, len, data, stride, res, rstride) encodes
+// n separate messages together, transposing them so that each is one
+// lane of rs_codec_encode_lanes.  Byte p of message i is at
+// data[i][p * stride] and it has len[i] bytes (shorter ones get leading
+// zeros).  Its check symbol j, highest order first, goes to
+// res[i][j * rstride].  Like rs_codec_decode it returns -1, having
+// written nothing, if a message does not fit in a code (len[i] over
+// 255 - nsym, or over the field's logmod - nsym), else 0.
+
+#define RS_BATCH 32             // messages encoded side by side
+
+int
+rs_codec_encode_batch (const rs_codec * rs, int n, const int *len, unsigned char *const *data, int stride, unsigned char *const *res, int rstride)
+{
+   unsigned char soa[255 * RS_BATCH],   // a whole code is at most 255 symbols
+     par[255 * RS_BATCH];
+   int g,
+     l,
+     p,
+     most = (rs->logmod < 255 ? rs->logmod : 255) - rs->rlen;
+   for (l = 0; l < n; l++)
+      if (len[l] < 0 || len[l] > most)
+         return -1;
+   for (g = 0; g < n; g += RS_BATCH)
+   {
+      int lanes = n - g < RS_BATCH ? n - g : RS_BATCH,
+         max = 0;
+      for (l = 0; l < lanes; l++)
+         if (len[g + l] > max)
+            max = len[g + l];
+      for (l = 0; l < lanes; l++)
+      {
+         const unsigned char *d = data[g + l];
+         int off = max - len[g + l];
+         for (p = 0; p < off; p++)
+            soa[p * RS_BATCH + l] = 0;
+         for (; p < max; p++, d += stride)
+            soa[p * RS_BATCH + l] = *d;
+      }
+      rs_codec_encode_lanes (rs, lanes, max, lanes, soa, RS_BATCH, par, RS_BATCH);
+      for (l = 0; l < lanes; l++)
+      {
+         unsigned char *r = res[g + l];
+         for (p = 0; p < rs->rlen; p++, r += rstride)
+            *r = par[p * RS_BATCH + l];
+      }
+   }
+   return 0;
+}
+
+// Checking: a codeword (data followed by its check symbols, highest
+// order first, as transmitted) is valid if it is a multiple of the
+// generator, i.e. if it is zero at each of the generator's roots.  The
+// values there are the syndromes, found by Horner's rule.
+
+// the product table row of each root, for ECC200
+static inline void
+rs_root_rows (const rs_codec * rs, const unsigned char **row)
+{
+   int j;
+   for (j = 0; j < rs->rlen; j++)
+      row[j] = rs_mul12d[rs->alog[(rs->index + j) % 255]];
+}
+
+#ifdef RS_SIMD
+// SIMD syndromes.  Splitting the codeword c(x) into 16 interleaved
+// parts, c(x) = sum of x**(15-r) * C_r(x**16), each part is one byte
+// lane of a vector and Horner's rule runs on all 16 at once, multiplying
+// by the constant root**16 with PSHUFB nibble lookups.  The parts are
+// then folded together in halves: a_r * root**8 + a_(r+8) leaves the
+// value as 8 parts in x**8, and so on down to one.  The codeword is
+// zero padded at the front to a whole number of vectors.
+
+// v * m in every byte, m given by its nibble tables
+static inline __attribute__ ((target ("ssse3"), always_inline)) __m128i
+rs_mul_ssse3 (__m128i v, const unsigned char *tab)
+{
+   const __m128i lomask = _mm_set1_epi8 (0x0F);
+   return _mm_xor_si128 (_mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) tab), _mm_and_si128 (v, lomask)),
+                         _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (tab + 16)), _mm_and_si128 (_mm_srli_epi16 (v, 4), lomask)));
+}
+
+// fold the 16 parts in v for root 2**e down to the syndrome
+static inline __attribute__ ((target ("ssse3"), always_inline)) int
+rs_fold_ssse3 (__m128i v, int e)
+{
+   v = _mm_xor_si128 (rs_mul_ssse3 (v, rs_nib12d[rs_alog12d[e * 8 % 255]][0]), _mm_srli_si128 (v, 8));
+   v = _mm_xor_si128 (rs_mul_ssse3 (v, rs_nib12d[rs_alog12d[e * 4 % 255]][0]), _mm_srli_si128 (v, 4));
+   v = _mm_xor_si128 (rs_mul_ssse3 (v, rs_nib12d[rs_alog12d[e * 2 % 255]][0]), _mm_srli_si128 (v, 2));
+   v = _mm_xor_si128 (rs_mul_ssse3 (v, rs_nib12d[rs_alog12d[e % 255]][0]), _mm_srli_si128 (v, 1));
+   return _mm_cvtsi128_si32 (v) & 0xFF;
+}
+
+static __attribute__ ((target ("ssse3"))) void
+rs_syndromes_ssse3 (const rs_codec * rs, int len, const unsigned char *data, unsigned char *synd)
+{
+   unsigned char buf[256 + 16];
+   int pad = -len & 15,
+      n = (len + pad) / 16,
+      i,
+      j;
+   memset (buf, 0, pad);
+   memcpy (buf + pad, data, len);
+   for (j = 0; j < rs->rlen; j++)
+   {
+      int e = rs->index + j;
+      const unsigned char *tab = rs_nib12d[rs->alog[e * 16 % 255]][0];  // root**16
+      __m128i v = _mm_setzero_si128 ();
+      for (i = 0; i < n; i++)
+         v = _mm_xor_si128 (rs_mul_ssse3 (v, tab), _mm_loadu_si128 ((const __m128i *) (buf + 16 * i)));
+      synd[j] = rs_fold_ssse3 (v, e);
+   }
+}
+
+// AVX2: the same with 32 parts, the first fold being of the two halves
+static inline __attribute__ ((target ("avx2"), always_inline)) __m256i
+rs_mul_avx2 (__m256i v, const unsigned char *tab)
+{
+   const __m256i lomask = _mm256_set1_epi8 (0x0F);
+   return _mm256_xor_si256 (_mm256_shuffle_epi8 (_mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) tab)), _mm256_and_si256 (v, lomask)),
+                            _mm256_shuffle_epi8 (_mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) (tab + 16))),
+                                                 _mm256_and_si256 (_mm256_srli_epi16 (v, 4), lomask)));
+}
+
+static __attribute__ ((target ("avx2"))) void
+rs_syndromes_avx2 (const rs_codec * rs, int len, const unsigned char *data, unsigned char *synd)
+{
+   unsigned char buf[256 + 32];
+   int pad = -len & 31,
+      n = (len + pad) / 32,
+      i,
+      j;
+   memset (buf, 0, pad);
+   memcpy (buf + pad, data, len);
+   for (j = 0; j < rs->rlen; j++)
+   {
+      int e = rs->index + j;
+      const unsigned char *tab = rs_nib12d[rs->alog[e * 32 % 255]][0];  // root**32
+      __m256i v = _mm256_setzero_si256 ();
+      for (i = 0; i < n; i++)
+         v = _mm256_xor_si256 (rs_mul_avx2 (v, tab), _mm256_loadu_si256 ((const __m256i *) (buf + 32 * i)));
+      synd[j] = rs_fold_ssse3 (_mm_xor_si128 (rs_mul_ssse3 (_mm256_castsi256_si128 (v), rs_nib12d[rs->alog[e * 16 % 255]][0]),
+                                              _mm256_extracti128_si256 (v, 1)), e);
+   }
+}
+#endif
+
+// rs_codec_syndromes(rs, len, data, synd) evaluates the len byte
+// codeword at the nsym roots of the generator, into synd[0..nsym-1].
+// All zero means the codeword is valid.
+
+void
+rs_codec_syndromes (const rs_codec * rs, int len, const unsigned char *data, unsigned char *synd)
+{
+   int i,
+     j;
+   if (rs->gfpoly != 0x12d || rs->rlen > RS_MAXNSYM12D)
+   {                            // general field, by logs
+      const int *log = rs->log,
+         *alog = rs->alog;
+      for (j = 0; j < rs->rlen; j++)
+      {
+         int s = 0,
+            e = (rs->index + j) % rs->logmod;
+         for (i = 0; i < len; i++)
+            s = (s ? alog[(log[s] + e) % rs->logmod] : 0) ^ data[i];
+         synd[j] = s;
+      }
+      return;
+   }
+#ifdef RS_SIMD
+   if (len <= 255 && len >= 64 && rs_simd_level () >= 2)
+   {
+      rs_syndromes_avx2 (rs, len, data, synd);
+      return;
+   } else if (len <= 255 && len >= 16 && rs_simd_level () >= 1)
+   {
+      rs_syndromes_ssse3 (rs, len, data, synd);
+      return;
+   }
+#endif
+   {                            // ECC200, by product table rows
+      const unsigned char *row[RS_MAXNSYM12D];
+      rs_root_rows (rs, row);
+      for (j = 0; j < rs->rlen; j++)
+      {
+         unsigned char s = 0;
+         for (i = 0; i < len; i++)
+            s = row[j][s] ^ data[i];
+         synd[j] = s;
+      }
+   }
+}
+
+// rs_codec_check(rs, len, data) returns 1 if the len byte codeword is
+// valid (all its syndromes are zero), else 0.
+
+int
+rs_codec_check (const rs_codec * rs, int len, const unsigned char *data)
+{
+   unsigned char synd[256];
+   int j;
+   rs_codec_syndromes (rs, len, data, synd);
+   for (j = 0; j < rs->rlen; j++)
+      if (synd[j])
+         return 0;
+   return 1;
+}
+
+// Decoding: from the syndromes, Berlekamp-Massey finds the error
+// locator polynomial Lambda(x), whose roots are the inverses of the
+// error locations X = 2**(len-1-i) (data[i] being the coefficient of
+// x**(len-1-i)).  Known erasures seed Lambda with their own locator, so
+// that each costs one check symbol instead of two.  A Chien search
+// tries every position for a root, and Forney's formula gives the error
+// value there: X**(1-index) * Omega(1/X) / Lambda'(1/X), with the
+// evaluator Omega(x) = S(x) * Lambda(x) mod x**nsym.
+
+static inline int
+rs_gf_mul (const rs_codec * rs, int a, int b)
+{
+   if (rs->gfpoly == 0x12d)
+      return rs_mul12d[a][b];
+   return a && b ? rs->alog[(rs->log[a] + rs->log[b]) % rs->logmod] : 0;
+}
+
+// p(2**e), p having deg+1 coefficients, low order first
+static int
+rs_gf_eval (const rs_codec * rs, const int *p, int deg, int e)
+{
+   int x = rs->alog[(e % rs->logmod + rs->logmod) % rs->logmod],
+      v = 0,
+      k;
+   for (k = deg; k >= 0; k--)
+      v = rs_gf_mul (rs, v, x) ^ p[k];
+   return v;
+}
+
+// rs_codec_decode(rs, len, data, nerase, erase) corrects the len byte
+// codeword in place.  erase lists nerase positions (indexes into data)
+// known to be bad, e.g. unreadable, which may be empty.  Up to
+// nsym - nerase errors can be corrected, in addition to erasures, as
+// long as twice the errors and the erasures come to at most nsym.
+// Returns the number of bytes corrected, or -1 if the codeword is
+// beyond correction (in which case data is left as it was).
+
+int
+rs_codec_decode (const rs_codec * rs, int len, unsigned char *data, int nerase, const int *erase)
+{
+   unsigned char s8[256];
+   int nsym = rs->rlen,
+      logmod = rs->logmod,
+      synd[256],
+      lambda[257],
+      b[257],
+      t[257],
+      omega[256],
+      where[256],
+      value[256],
+      L,
+      r,
+      i,
+      k,
+      n = 0;
+
+   if (nerase > nsym || len > logmod)
+      return -1;
+   rs_codec_syndromes (rs, len, data, s8);
+   for (k = 0, i = 0; i < nsym; i++)
+      k |= synd[i] = s8[i];
+   if (!k)
+      return 0;                 // nothing wrong
+
+   // erasure locator: product of (1 - X x)
+   memset (lambda, 0, sizeof (lambda));
+   lambda[0] = 1;
+   for (k = 0; k < nerase; k++)
+   {
+      int x;
+      if (erase[k] < 0 || erase[k] >= len)
+         return -1;
+      x = rs->alog[len - 1 - erase[k]];
+      for (i = k + 1; i > 0; i--)
+         lambda[i] ^= rs_gf_mul (rs, lambda[i - 1], x);
+   }
+   memcpy (b, lambda, sizeof (b));
+   L = nerase;
+
+   // Berlekamp-Massey, starting after the erasures
+   for (r = nerase; r < nsym; r++)
+   {
+      int delta = 0;
+      for (i = 0; i <= L && i <= r; i++)
+         delta ^= rs_gf_mul (rs, lambda[i], synd[r - i]);
+      memmove (b + 1, b, nsym * sizeof (int));  // b = x * b
+      b[0] = 0;
+      if (!delta)
+         continue;
+      for (i = 0; i <= nsym; i++)
+         t[i] = lambda[i] ^ rs_gf_mul (rs, delta, b[i]);
+      if (2 * L <= r + nerase)
+      {
+         int inv = rs->alog[(logmod - rs->log[delta]) % logmod];
+         L = r + 1 + nerase - L;
+         for (i = 0; i <= nsym; i++)
+            b[i] = rs_gf_mul (rs, lambda[i], inv);
+      }
+      memcpy (lambda, t, sizeof (t));
+   }
+   if (2 * L - nerase > nsym)
+      return -1;
+   for (i = nsym; i > L; i--)
+      if (lambda[i])
+         return -1;
+
+   // Chien search
+   for (i = 0; i < len && n <= L; i++)
+      if (!rs_gf_eval (rs, lambda, L, -(len - 1 - i)))
+         where[n++] = i;
+   if (n != L)
+      return -1;                // not all the roots are in the codeword
+
+   // Forney
+   for (k = 0; k < nsym; k++)
+   {
+      omega[k] = 0;
+      for (i = 0; i <= k && i <= L; i++)
+         omega[k] ^= rs_gf_mul (rs, synd[k - i], lambda[i]);
+   }
+   for (k = 0; k < n; k++)
+   {
+      int e = len - 1 - where[k],
+         num = rs_gf_eval (rs, omega, nsym - 1, -e),
+         den = 0;
+      for (i = 1; i <= L; i += 2)       // Lambda'(1/X), odd terms only
+         den ^= rs_gf_mul (rs, lambda[i], rs->alog[((-e * (i - 1)) % logmod + logmod) % logmod]);
+      if (!den)
+         return -1;
+      value[k] = rs_gf_mul (rs, rs_gf_mul (rs, num, rs->alog[(logmod - rs->log[den]) % logmod]),
+                            rs->alog[((e * (1 - rs->index)) % logmod + logmod) % logmod]);
+   }
+
+   for (k = 0; k < n; k++)
+      data[where[k]] ^= value[k];
+   if (!rs_codec_check (rs, len, data))
+   {                            // miscorrection, put it back
+      for (k = 0; k < n; k++)
+         data[where[k]] ^= value[k];
+      return -1;
+   }
+   for (i = 0, k = 0; k < n; k++)
+      if (value[k])
+         i++;
+   return i;
+}
+
+// rs_codec_free(rs) returns any storage malloced for the codec.  The
+// codec can then be set up again with rs_codec_init_gf.
+
+void
+rs_codec_free (rs_codec * rs)
+{
+   if (rs->logbuf)
+      free (rs->logbuf);
+   if (rs->polybuf)
+      free (rs->polybuf);
+   rs->logbuf = rs->polybuf = NULL;
+   rs->log = rs->alog = rs->rspoly = NULL;
+   rs->mul[0] = NULL;
+}
+
+// The original interface, working on a single static codec
+
+void
+rs_init_gf (int poly)
+{
+   rs_codec_init_gf (&rs_static, poly);
+}
+
+void
+rs_init_code (int nsym, int index)
+{
+   rs_codec_init_code (&rs_static, nsym, index);
+}
+
+void
+rs_encode (int len, unsigned char *data, unsigned char *res)
+{
+   rs_codec_encode (&rs_static, len, data, res);
+}
+
+#ifdef RS_TEST
+// The following tests the routines with the ISO/IEC 16022 Annexe R data,
+// checks the prebuilt generator polynomials and the table driven encoder
+// and SIMD encoders against run time ones, and times the per-symbol
+// generator setup the prebuilt table saves and the encoders.
+// Build with:  ruby gentables.rb && cc -O2 -DRS_TEST -o reedsol reedsol.c
 int
 main (void)
 {
@@ -155,6 +986,10 @@ main (void)
 
    unsigned char data[9] = { 142, 164, 186 };
    unsigned char out[5];
+   int nsym,
+     n,
+     bad = 0;
+   clock_t t;
 
    rs_init_gf (0x12d);
    rs_init_code (5, 1);
@@ -165,6 +1000,327 @@ main (void)
    for (i = 4; i >= 0; i--)
       printf ("  %d\n", out[i]);
 
-   return 0;
+   for (nsym = 1; nsym <= RS_MAXNSYM12D; nsym++)
+   {
+      int *poly = rs_make_poly (&rs_static, nsym, 1);
+      rs_init_code (nsym, 1);
+      for (i = 0; i <= nsym; i++)
+         if (poly[i] != rs_static.rspoly[i])
+            bad++;
+      free (poly);
+   }
+   printf ("Prebuilt generator polynomials: %s\n", bad ? "MISMATCH" : "ok");
+
+#define BENCH 200000
+   printf ("Generator setup per symbol (nsym 68, %d runs):\n", BENCH);
+   t = clock ();
+   for (n = 0; n < BENCH; n++)
+      free (rs_make_poly (&rs_static, 68, 1));
+   printf ("  built at run time  %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / BENCH);
+   t = clock ();
+   for (n = 0; n < BENCH; n++)
+      rs_init_code (68, 1);
+   printf ("  prebuilt lookup    %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / BENCH);
+
+   {                            // 144x144 block: 156 data, 62 check
+      unsigned char block[156],
+        res1[62],
+        res2[62];
+      for (i = 0; i < 156; i++)
+         block[i] = i * 7 + 3;
+      rs_init_code (62, 1);
+      rs_encode_log (&rs_static, 156, block, res1);
+      rs_encode_mul (&rs_static, 156, block, res2);
+      for (i = 0; i < 62; i++)
+         if (res1[i] != res2[i])
+            bad++;
+      printf ("Table driven encoder: %s\n", bad ? "MISMATCH" : "ok");
+      printf ("Encoding one 144x144 block (%d runs):\n", BENCH / 10);
+      t = clock ();
+      for (n = 0; n < BENCH / 10; n++)
+         rs_encode_log (&rs_static, 156, block, res1);
+      printf ("  log/alog           %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 10));
+      t = clock ();
+      for (n = 0; n < BENCH / 10; n++)
+         rs_encode_mul (&rs_static, 156, block, res2);
+      printf ("  product rows       %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 10));
+#ifdef RS_SIMD
+      if (rs_simd_level () >= 1)
+      {
+         t = clock ();
+         for (n = 0; n < BENCH / 10; n++)
+            rs_encode_ssse3 (&rs_static, 156, block, res2);
+         printf ("  SSSE3              %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 10));
+      }
+      if (rs_simd_level () >= 2)
+      {
+         t = clock ();
+         for (n = 0; n < BENCH / 10; n++)
+            rs_encode_avx2 (&rs_static, 156, block, res2);
+         printf ("  AVX2               %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 10));
+      }
+#endif
+   }
+
+#ifdef RS_SIMD
+   {                            // SIMD encoders against the table driven one, every code size
+      unsigned char block[256],
+        res1[RS_MAXNSYM12D],
+        res2[RS_MAXNSYM12D];
+      int simdbad = 0;
+      for (i = 0; i < 256; i++)
+         block[i] = rand ();
+      for (nsym = 1; nsym <= RS_MAXNSYM12D; nsym++)
+      {
+         rs_init_code (nsym, 1);
+         rs_encode_mul (&rs_static, 255 - nsym, block, res1);
+         if (rs_simd_level () >= 1)
+         {
+            rs_encode_ssse3 (&rs_static, 255 - nsym, block, res2);
+            for (i = 0; i < nsym; i++)
+               if (res1[i] != res2[i])
+                  simdbad++;
+         }
+         if (rs_simd_level () >= 2)
+         {
+            rs_encode_avx2 (&rs_static, 255 - nsym, block, res2);
+            for (i = 0; i < nsym; i++)
+               if (res1[i] != res2[i])
+                  simdbad++;
+         }
+      }
+      printf ("SIMD encoders (level %d): %s\n", rs_simd_level (), simdbad ? "MISMATCH" : "ok");
+      bad += simdbad;
+   }
+#endif
+
+   {                            // interleaved encoders, 144x144 layout: 1558 data, 10 blocks of 62
+      unsigned char cw[2178],
+        ref[2178];
+      int lanebad = 0;
+      for (i = 0; i < 1558; i++)
+         cw[i] = ref[i] = rand ();
+      rs_init_code (62, 1);
+      rs_encode_lanes_scalar (&rs_static, 10, 156, 8, ref, 10, ref + 1558, 10);
+      rs_codec_encode_lanes (&rs_static, 10, 156, 8, cw, 10, cw + 1558, 10);
+      for (i = 0; i < 2178; i++)
+         if (cw[i] != ref[i])
+            lanebad++;
+#ifdef RS_SIMD
+      if (rs_simd_level () >= 1)
+      {
+         rs_encode_lanes_ssse3 (&rs_static, 10, 156, 8, cw, 10, cw + 1558, 10);
+         for (i = 0; i < 2178; i++)
+            if (cw[i] != ref[i])
+               lanebad++;
+      }
+#endif
+#ifdef RS_SIMD
+      if (rs_simd_level () >= 2)
+      {                         // and 24 lanes, for AVX2
+         unsigned char big[100 * 24],
+           res1[62 * 24],
+           res2[62 * 24];
+         for (i = 0; i < 100 * 24; i++)
+            big[i] = rand ();
+         rs_encode_lanes_scalar (&rs_static, 24, 100, 5, big, 24, res1, 24);
+         rs_encode_lanes_avx2 (&rs_static, 24, 100, 5, big, 24, res2, 24);
+         for (i = 0; i < 62 * 24; i++)
+            if (res1[i] != res2[i])
+               lanebad++;
+      }
+#endif
+      printf ("Interleaved encoders: %s\n", lanebad ? "MISMATCH" : "ok");
+      bad += lanebad;
+      printf ("Encoding all 10 blocks of a 144x144 symbol (%d runs):\n", BENCH / 10);
+      t = clock ();
+      for (n = 0; n < BENCH / 10; n++)
+         rs_encode_lanes_scalar (&rs_static, 10, 156, 8, cw, 10, cw + 1558, 10);
+      printf ("  block at a time    %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 10));
+      t = clock ();
+      for (n = 0; n < BENCH / 10; n++)
+         rs_codec_encode_lanes (&rs_static, 10, 156, 8, cw, 10, cw + 1558, 10);
+      printf ("  interleaved        %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 10));
+   }
+
+   {                            // batches of 24x24 codes: 36 data, 24 check
+#define NBATCH 1000
+      static unsigned char msgs[NBATCH][60];
+      unsigned char *d[NBATCH],
+       *r[NBATCH];
+      int lens[NBATCH],
+        batchbad = 0;
+      for (n = 0; n < NBATCH; n++)
+      {
+         for (i = 0; i < 36; i++)
+            msgs[n][i] = rand ();
+         d[n] = msgs[n];
+         r[n] = msgs[n] + 36;
+         lens[n] = 36 - (n % 3 == 0);   // some one short
+      }
+      rs_init_code (24, 1);
+      rs_codec_encode_batch (&rs_static, NBATCH, lens, d, 1, r, 1);
+      for (n = 0; n < NBATCH; n++)
+      {
+         unsigned char res1[24];
+         rs_encode (lens[n], msgs[n], res1);
+         for (i = 0; i < 24; i++)
+            if (r[n][i] != res1[23 - i])
+               batchbad++;
+      }
+      r[1][0] ^= 1;             // must be left alone
+      lens[NBATCH - 1] = 255 - 24 + 1;  // one too long for the code
+      if (rs_codec_encode_batch (&rs_static, NBATCH, lens, d, 1, r, 1) != -1 || rs_codec_check (&rs_static, 60, msgs[1]))
+         batchbad++;
+      lens[NBATCH - 1] = 36 - ((NBATCH - 1) % 3 == 0);
+      r[1][0] ^= 1;
+      printf ("Batch encoder: %s\n", batchbad ? "MISMATCH" : "ok");
+      bad += batchbad;
+      printf ("Encoding %d 24x24 codes (%d runs):\n", NBATCH, BENCH / 1000);
+      t = clock ();
+      for (i = 0; i < BENCH / 1000; i++)
+         for (n = 0; n < NBATCH; n++)
+            rs_encode (36, msgs[n], msgs[n] + 36);
+      printf ("  one at a time      %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 1000) / NBATCH);
+      t = clock ();
+      for (i = 0; i < BENCH / 1000; i++)
+         rs_codec_encode_batch (&rs_static, NBATCH, lens, d, 1, r, 1);
+      printf ("  batched            %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 1000) / NBATCH);
+   }
+
+   {                            // syndromes against plain Horner by logs, and checks
+      unsigned char cw[255],
+        synd[RS_MAXNSYM12D],
+        out2[RS_MAXNSYM12D];
+      int checkbad = 0,
+         len,
+         j;
+      for (nsym = 5; nsym <= RS_MAXNSYM12D; nsym++)
+         for (len = nsym + 1; len <= 255; len += 7)
+         {
+            rs_init_code (nsym, 1);
+            for (i = 0; i < len; i++)
+               cw[i] = rand ();
+            rs_codec_syndromes (&rs_static, len, cw, synd);
+            for (j = 0; j < nsym; j++)
+            {
+               int s = 0;
+               for (i = 0; i < len; i++)
+                  s = (s ? rs_static.alog[(rs_static.log[s] + 1 + j) % 255] : 0) ^ cw[i];
+               if (synd[j] != s)
+                  checkbad++;
+            }
+            rs_encode (len - nsym, cw, out2);
+            for (i = 0; i < nsym; i++)
+               cw[len - nsym + i] = out2[nsym - 1 - i];
+            if (!rs_codec_check (&rs_static, len, cw))
+               checkbad++;
+            cw[rand () % len] ^= 1 + rand () % 255;
+            if (rs_codec_check (&rs_static, len, cw))
+               checkbad++;
+         }
+      printf ("Syndromes: %s\n", checkbad ? "MISMATCH" : "ok");
+      bad += checkbad;
+
+      rs_init_code (62, 1);     // a 144x144 block
+      for (i = 0; i < 156; i++)
+         cw[i] = rand ();
+      rs_encode (156, cw, out2);
+      for (i = 0; i < 62; i++)
+         cw[156 + i] = out2[61 - i];
+      printf ("Checking a 144x144 block (%d runs):\n", BENCH);
+      t = clock ();
+      for (i = 0; i < BENCH; i++)
+      {
+         const unsigned char *row[RS_MAXNSYM12D];
+         int k;
+         rs_root_rows (&rs_static, row);
+         for (j = 0; j < 62; j++)
+         {
+            unsigned char s = 0;
+            for (k = 0; k < 218; k++)
+               s = row[j][s] ^ cw[k];
+            synd[j] = s;
+         }
+      }
+      printf ("  product rows       %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / BENCH);
+#ifdef RS_SIMD
+      t = clock ();
+      for (i = 0; i < BENCH; i++)
+         rs_syndromes_ssse3 (&rs_static, 218, cw, synd);
+      printf ("  SSSE3              %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / BENCH);
+      if (rs_simd_level () >= 2)
+      {
+         t = clock ();
+         for (i = 0; i < BENCH; i++)
+            rs_syndromes_avx2 (&rs_static, 218, cw, synd);
+         printf ("  AVX2               %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / BENCH);
+      }
+#endif
+   }
+
+   {                            // decoding with errors and erasures
+      unsigned char cw[255],
+        orig[255],
+        out2[RS_MAXNSYM12D];
+      int decodebad = 0,
+         erase[RS_MAXNSYM12D],
+         len,
+         run,
+         j;
+      for (nsym = 1; nsym <= RS_MAXNSYM12D; nsym++)
+         for (run = 0; run < 50; run++)
+         {
+            int ne = rand () % (nsym + 1),    // erasures
+               nerr = (nsym - ne) / 2,
+               pos[255];
+            len = nsym + 1 + rand () % (255 - nsym);
+            rs_init_code (nsym, 1);
+            for (i = 0; i < len - nsym; i++)
+               cw[i] = rand ();
+            rs_encode (len - nsym, cw, out2);
+            for (i = 0; i < nsym; i++)
+               cw[len - nsym + i] = out2[nsym - 1 - i];
+            memcpy (orig, cw, len);
+            for (i = 0; i < len; i++)
+               pos[i] = i;
+            for (i = 0; i < ne + nerr; i++)
+            {                   // distinct positions
+               int k = i + rand () % (len - i),
+                  p = pos[k];
+               pos[k] = pos[i];
+               pos[i] = p;
+               if (i < ne)
+                  erase[i] = p;
+               cw[p] ^= (i < ne ? rand () : 1 + rand () % 255);
+            }
+            n = rs_codec_decode (&rs_static, len, cw, ne, erase);
+            if (n < 0 || memcmp (cw, orig, len))
+               decodebad++;
+         }
+      printf ("Decoder: %s\n", decodebad ? "MISMATCH" : "ok");
+      bad += decodebad;
+
+      rs_init_code (62, 1);     // a 144x144 block with 31 errors
+      for (i = 0; i < 156; i++)
+         cw[i] = rand ();
+      rs_encode (156, cw, out2);
+      for (i = 0; i < 62; i++)
+         cw[156 + i] = out2[61 - i];
+      memcpy (orig, cw, 218);
+      printf ("Decoding a 144x144 block (%d runs):\n", BENCH / 100);
+      t = clock ();
+      for (i = 0; i < BENCH / 100; i++)
+      {
+         for (j = 0; j < 31; j++)
+            cw[j * 7] ^= 0x55;
+         rs_codec_decode (&rs_static, 218, cw, 0, erase);
+      }
+      printf ("  31 errors          %8.1f ns\n", (double) (clock () - t) * 1e9 / CLOCKS_PER_SEC / (BENCH / 100));
+      if (memcmp (cw, orig, 218))
+         bad++;
+   }
+
+   return bad != 0;
 }
 #endif
@@ -1,7 +1,36 @@
 /* don't compile in the main function from reedsol.c */
 #define LIB
 
+#define RS_MAXNSYM12D 68        // largest prebuilt ECC200 code, see gentables.rb
+
+// Reed-Solomon codec state, see reedsol.c
+// Zero it (or rs_codec_free it) before the first rs_codec_init_gf
+typedef struct rs_codec
+{
+   int gfpoly;
+   int symsize;                 // in bits
+   int logmod;                  // 2**symsize - 1
+   int rlen;
+   int index;                   // first root of the generator is 2**index
+   const int *log,
+    *alog,
+    *rspoly;
+   int *logbuf,                 // malloced log/alog for fields other than 0x12d
+    *polybuf;                   // malloced rspoly for codes not prebuilt
+   const unsigned char *mul[RS_MAXNSYM12D + 1]; // product row per rspoly coefficient, if prebuilt
+} rs_codec;
+
+void rs_codec_init_gf(rs_codec *rs, int poly);
+void rs_codec_init_code(rs_codec *rs, int nsym, int index);
+void rs_codec_encode(const rs_codec *rs, int len, unsigned char *data, unsigned char *res);
+void rs_codec_encode_lanes(const rs_codec *rs, int lanes, int len, int nlong, const unsigned char *data, int stride, unsigned char *res, int rstride);
+// each len[i] at most 255 - nsym (and logmod - nsym), else -1 and nothing encoded
+int rs_codec_encode_batch(const rs_codec *rs, int n, const int *len, unsigned char *const *data, int stride, unsigned char *const *res, int rstride);
+void rs_codec_syndromes(const rs_codec *rs, int len, const unsigned char *data, unsigned char *synd);
+int rs_codec_check(const rs_codec *rs, int len, const unsigned char *data);
+int rs_codec_decode(const rs_codec *rs, int len, unsigned char *data, int nerase, const int *erase);
+void rs_codec_free(rs_codec *rs);
+
 void rs_init_gf(int poly);
 void rs_init_code(int nsym, int index);
 void rs_encode(int len, unsigned char *data, unsigned char *res);
-
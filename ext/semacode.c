@@ -17,59 +17,123 @@
 #include "ruby.h"
 #include "semacode.h"
 
+/* a message to encode into a semacode, as passed through rb_ensure */
+struct encode_args {
+  semacode_t *semacode;
+  int message_length;
+  char *message;
+};
+
+/* the encoding proper, run with the semacode marked busy */
+static VALUE
+encode_symbol(VALUE arg)
+{
+  struct encode_args *args = (struct encode_args *) arg;
+  semacode_t *semacode = args->semacode;
+  int width, height;
+
+  // the size the message length alone would have picked
+  iec16022initf(&width, &height, args->message, semacode->flags & (IEC16022_RECT | IEC16022_DMRE));
+  
+  // encode the actual data
+  semacode->data = (char *) iec16022ecc200into(
+    &semacode->width, 
+    &semacode->height, 
+    &semacode->encoding, 
+    args->message_length, 
+    (unsigned char *) args->message, 
+    &semacode->raw_encoded_length,
+    &semacode->symbol_capacity, 
+    &semacode->ecc_bytes,
+    &semacode->stride,
+    semacode->flags,
+    (unsigned char *) semacode->buf,
+    semacode->scratch,
+    &semacode->spare);
+
+  if(width)
+    semacode->area_saved = width * height - semacode->width * semacode->height;
+
+  return Qnil;
+}
+
+static VALUE
+encode_done(VALUE arg)
+{
+  ((semacode_t *) arg)->busy = 0;
+  return Qnil;
+}
+
 /*
 
 Internal function that encodes a string of given length, storing
 the encoded result into an internal, private data structure. This
 structure is consulted for any operations, such as to get the 
-semacode dimensions. It deallocates any previous data before 
-generating a new encoding.
-
-Due to a bug in the underlying encoder, we do two things
-
- * append a space character before encoding, to get around
-   an off by one error lurking in the C code
-   
- * manually select the best barcode dimensions, to avoid
-   an encoder bug where sometimes no suitable encoding would
-   be found
+semacode dimensions. The buffers of any previous encoding are
+reused, so that encoding again does not allocate unless the
+message is longer than any before.
+
+The encoder lets other threads run while it works out the error
+correction of a large symbol, and the encoding it returns points into
+the reused buffers, so the semacode is marked busy meanwhile and
+encoding it again from another thread raises rather than reallocating
+them from under it.
+
+Due to a bug in the underlying encoder, we append a space character
+before encoding, to get around an off by one error lurking in the C
+code.
+
+The symbol size is left to the encoder, which picks the smallest that
+the encoding it plans fits, within the shape and sizes the flags allow.
+This used to be forced from the message length alone, which takes no
+account of digits packing two to a codeword or of C40 and Text packing
+three characters to two, so the area that size would have taken is
+kept to compare.
 
 */
 semacode_t* 
 encode_string(semacode_t *semacode, int message_length, char *message)
 {
+  semacode_t keep;
+  struct encode_args args;
+  char *copy;
+  int need;
+
   /* avoid obvious bad cases */
   if(semacode == NULL || message == NULL || message_length < 1) {
     return NULL;
   }
+  if(semacode->busy)
+    rb_raise(rb_eRuntimeError, "semacode is being encoded in another thread");
     
-  /* deallocate if exists already */
-  if(semacode->data != NULL)
-    free(semacode->data);
-
-  /* deallocate if exists already */
-  if(semacode->encoding != NULL)
-    free(semacode->encoding);
-        
+  /* keep the buffers, grown if need be, and the options */
+  keep = *semacode;
+  if(keep.buf == NULL)
+    keep.buf = ALLOC_N(char, iec16022ecc200gridsize(0, 0, 1));
+  need = iec16022ecc200scratchsize(message_length + 1);
+  if(keep.scratch_size < need + message_length + 2) {
+    keep.scratch_size = need + message_length + 2;
+    REALLOC_N(keep.scratch, char, keep.scratch_size);
+  }
   bzero(semacode, sizeof(semacode_t));
+  semacode->flags = keep.flags;
+  semacode->buf = keep.buf;
+  semacode->scratch = keep.scratch;
+  semacode->scratch_size = keep.scratch_size;
+  semacode->busy = 1;
   
-  // work around encoding bug by appending an extra character.
-  strcat(message, " ");
-  message_length++;
+  // work around encoding bug by appending an extra character, to a
+  // copy after the encoding's scratch, so a NUL in the message is kept
+  // and the caller's string is left alone.
+  copy = semacode->scratch + need;
+  memcpy(copy, message, message_length);
+  copy[message_length++] = ' ';
+  copy[message_length] = 0;
   
-  // choose the best grid that will hold our message
-  iec16022init(&semacode->width, &semacode->height, message);
-  
-  // encode the actual data
-  semacode->data = (char *) iec16022ecc200(
-    &semacode->width, 
-    &semacode->height, 
-    &semacode->encoding, 
-    message_length, 
-    (unsigned char *) message, 
-    &semacode->raw_encoded_length,
-    &semacode->symbol_capacity, 
-    &semacode->ecc_bytes);
+  args.semacode = semacode;
+  args.message_length = message_length;
+  args.message = copy;
+  rb_ensure(encode_symbol, (VALUE) &args, encode_done, (VALUE) semacode);
 
   return semacode;
 }
@@ -89,9 +153,9 @@ static void
 semacode_free(semacode_t *semacode)
 {
   if(semacode != NULL) {
-    if(semacode->data != NULL)
-      free(semacode->encoding);
-      free(semacode->data);      
+    /* data and encoding point into these */
+    free(semacode->buf);
+    free(semacode->scratch);
     /* zero before freeing */
     bzero(semacode, sizeof(semacode));
     free(semacode);
@@ -105,6 +169,62 @@ semacode_allocate(VALUE klass)
   return Data_Make_Struct(klass, semacode_t, semacode_mark, semacode_free, semacode); 
 }
 
+/*
+  The longer side of the symbol allowed by option name, in modules,
+  or 0 if it is not given.
+*/
+static int
+semacode_side(VALUE options, const char *name)
+{
+  VALUE side = rb_hash_aref(options, ID2SYM(rb_intern(name)));
+  int n;
+
+  if(NIL_P(side))
+    return 0;
+  n = NUM2INT(side);
+  if(n < 1 || n > 144)
+    rb_raise(rb_eArgError, "%s must be from 1 to 144", name);
+  return n;
+}
+
+/*
+  The size selection flags for an options hash given to initialize
+  or encode: :shape, which is :square (the default), :rectangle to
+  prefer rectangular symbols when the message fits one, or :any for
+  whichever is smallest; :dmre, true to count the DMRE rectangles as
+  well; and :min_size and :max_size, bounds on the longer side.
+*/
+static int
+semacode_flags(VALUE options)
+{
+  VALUE shape;
+  int flags, min, max;
+
+  if(NIL_P(options))
+    return IEC16022_SMALLEST;
+  Check_Type(options, T_HASH);
+  shape = rb_hash_aref(options, ID2SYM(rb_intern("shape")));
+  if(NIL_P(shape) || shape == ID2SYM(rb_intern("square")))
+    flags = IEC16022_SMALLEST;
+  else if(shape == ID2SYM(rb_intern("rectangle")))
+    flags = IEC16022_RECT;
+  else if(shape == ID2SYM(rb_intern("any")))
+    flags = IEC16022_RECT | IEC16022_SMALLEST;
+  else
+    rb_raise(rb_eArgError, "unknown shape, must be :square, :rectangle or :any");
+  if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("dmre"))))) {
+    /* rectangles unless a shape is given, but never a square only one */
+    if(!NIL_P(shape) && !(flags & IEC16022_RECT))
+      rb_raise(rb_eArgError, ":dmre needs the :rectangle or :any shape");
+    flags = (flags & IEC16022_RECT ? flags : IEC16022_RECT) | IEC16022_DMRE;
+  }
+  min = semacode_side(options, "min_size");
+  max = semacode_side(options, "max_size");
+  if(max && min > max)
+    rb_raise(rb_eArgError, "min_size is more than max_size");
+  return flags | IEC16022_MINSIDE(min) | IEC16022_MAXSIDE(max);
+}
+
 /* 
   Initialize the semacode. This function is called after a semacode is
   created. Ruby objects are created using a new method, and then initialized
@@ -116,16 +236,29 @@ semacode_allocate(VALUE klass)
   The string in the argument is encoded and the semacode is returned
   initialized and ready for use.
   
+  The smallest square symbol the string fits is picked. An options
+  hash may follow the string. Give :shape => :rectangle to get a
+  rectangular semacode (8x18 up to 16x48) when the string fits one,
+  instead of a square one, or :shape => :any for whichever is smaller.
+  Give :dmre => true to also use the DMRE rectangles (8x48 up to 26x64),
+  which fit more in less area but are not read by every scanner; it
+  implies :shape => :rectangle, and raises with :shape => :square. Give
+  :min_size or :max_size to bound the longer side of the symbol, in
+  modules. These are kept for later encodes.
+
 */
 static VALUE
-semacode_init(VALUE self, VALUE message)
+semacode_init(int argc, VALUE *argv, VALUE self)
 {
   semacode_t *semacode;
+  VALUE message, options;
   
+  rb_scan_args(argc, argv, "11", &message, &options);
   if (!rb_respond_to(message, rb_intern ("to_s")))
       rb_raise(rb_eRuntimeError, "target must respond to 'to_s'");
 
   Data_Get_Struct(self, semacode_t, semacode);
+  semacode->flags = semacode_flags(options);
   encode_string(semacode, StringValueLen(message), StringValuePtr(message));
   
   return self;
@@ -152,10 +285,10 @@ semacode_grid(semacode_t *semacode)
   VALUE ret = rb_ary_new2(h);
 
   int x, y;
-	for (y = h - 1; y >= 0; y--) {
+	for (y = 0; y < h; y++) {
 	  VALUE ary = rb_ary_new2(w);
 		for (x = 0; x < w; x++) {
-		  if(semacode->data[y * w + x])
+		  if(SEMACODE_BIT(semacode, x, y))
 		    rb_ary_push(ary, Qtrue);
 		  else
 		    rb_ary_push(ary, Qfalse);
@@ -197,9 +330,9 @@ semacode_to_s(VALUE self)
   
   str = rb_str_new2("");
   
-	for (y = h - 1; y >= 0; y--) {
+	for (y = 0; y < h; y++) {
 		for (x = 0; x < w; x++) {
-		  if(semacode->data[y * w + x])
+		  if(SEMACODE_BIT(semacode, x, y))
 		    rb_str_cat(str, "1", 1);
 		  else
 		    rb_str_cat(str, "0", 1);
@@ -222,22 +355,23 @@ semacode_to_s(VALUE self)
   row is the same as the semacode width, and the number of rows is the same
   as the semacode height.
 
+  The options are as for initialize, and if left out, those given
+  before are used again.
+
 */
 static VALUE
-semacode_encode(VALUE self, VALUE message)
+semacode_encode(int argc, VALUE *argv, VALUE self)
 {
   semacode_t *semacode;
+  VALUE message, options;
   
+  rb_scan_args(argc, argv, "11", &message, &options);
   if (!rb_respond_to(message, rb_intern ("to_s")))
       rb_raise(rb_eRuntimeError, "target must respond to 'to_s'");
   
   Data_Get_Struct(self, semacode_t, semacode);
-  
-  /* free previous string if that exists */
-  if(semacode->data != NULL) {
-    free(semacode->data);
-    semacode->data == NULL;
-  }
+  if(argc > 1)
+    semacode->flags = semacode_flags(options);
   
   /* do a new encoding */
   DATA_PTR(self) = encode_string(semacode, StringValueLen(message), StringValuePtr(message));
@@ -346,6 +480,34 @@ semacode_symbol_size(VALUE self)
   return INT2FIX(semacode->symbol_capacity);
 }
 
+/*  
+  This returns the number of data codewords left over as padding,
+  which more data could use without the symbol getting any bigger.
+*/
+static VALUE
+semacode_spare_codewords(VALUE self)
+{
+  semacode_t *semacode;
+  Data_Get_Struct(self, semacode_t, semacode);
+
+  return INT2FIX(semacode->spare);
+}
+
+/*  
+  This returns the modules saved by letting the encoder pick the
+  size, against the size picked from the length of the string alone
+  as was done before. It is negative if :min_size made the symbol
+  bigger than that.
+*/
+static VALUE
+semacode_area_saved(VALUE self)
+{
+  semacode_t *semacode;
+  Data_Get_Struct(self, semacode_t, semacode);
+
+  return INT2FIX(semacode->area_saved);
+}
+
 /*  
   This returns the number of bytes that are being devoted to
   error correction.
@@ -359,6 +521,265 @@ semacode_ecc_bytes(VALUE self)
   return INT2FIX(semacode->ecc_bytes);
 }
 
+/*
+  This returns the codewords of the semacode, the data followed by
+  the error correction, as a binary string. They are read back out
+  of the symbol, just as a reader would see them.
+*/
+static VALUE
+semacode_codewords(VALUE self)
+{
+  semacode_t *semacode;
+  unsigned char binary[4096];
+  unsigned char *grid;
+  int w, h, x, y, len;
+  Data_Get_Struct(self, semacode_t, semacode);
+
+  if(semacode->data == NULL)
+    return Qnil;
+
+  w = semacode->width;
+  h = semacode->height;
+  grid = ALLOC_N(unsigned char, w * h);
+  for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++)
+      grid[(h - 1 - y) * w + x] = SEMACODE_BIT(semacode, x, y);
+  len = iec16022ecc200codewords(w, h, grid, binary);
+  free(grid);
+  return rb_str_new((char *) binary, len);
+}
+
+/*
+  This reads the codewords back out of a symbol given as an array
+  of rows of booleans, top row first, as returned by Encoder#data.
+  It returns them as a binary string, see Encoder#codewords.
+*/
+static VALUE
+semacode_read_codewords(VALUE self, VALUE rows)
+{
+  unsigned char binary[4096];
+  unsigned char *grid;
+  int w, h, x, y, len;
+
+  Check_Type(rows, T_ARRAY);
+  h = RARRAY_LEN(rows);
+  if(h < 1)
+    rb_raise(rb_eArgError, "no rows");
+  Check_Type(rb_ary_entry(rows, 0), T_ARRAY);
+  w = RARRAY_LEN(rb_ary_entry(rows, 0));
+  grid = ALLOC_N(unsigned char, w * h);
+  for (y = 0; y < h; y++) {
+    VALUE row = rb_ary_entry(rows, y);
+    if(TYPE(row) != T_ARRAY || RARRAY_LEN(row) != w) {
+      free(grid);
+      rb_raise(rb_eArgError, "rows must be arrays of the same length");
+    }
+    for (x = 0; x < w; x++)
+      grid[(h - 1 - y) * w + x] = RTEST(rb_ary_entry(row, x));
+  }
+  len = iec16022ecc200codewords(w, h, grid, binary);
+  free(grid);
+  if(len == 0)
+    rb_raise(rb_eRangeError, "invalid size for barcode");
+  return rb_str_new((char *) binary, len);
+}
+
+/*
+  This checks the error correction of codewords (a binary string, as
+  returned by Encoder#codewords) for a symbol of the given width and
+  height. It only tells whether they are intact, true or false, and
+  does not try to correct anything, so it is fast.
+*/
+static VALUE
+semacode_check(VALUE self, VALUE codewords, VALUE width, VALUE height)
+{
+  int ok;
+
+  StringValue(codewords);
+  ok = iec16022ecc200check(NUM2INT(width), NUM2INT(height),
+    RSTRING_LEN(codewords), (unsigned char *) RSTRING_PTR(codewords));
+  if(ok < 0)
+    rb_raise(rb_eRangeError, "codewords do not fit a %dx%d barcode",
+      NUM2INT(width), NUM2INT(height));
+  return ok ? Qtrue : Qfalse;
+}
+
+/* erasures given to correct/decode, as a C array of codeword indexes */
+static int
+semacode_erasures(VALUE erasures, int *erase, int max)
+{
+  int n, i;
+
+  if(NIL_P(erasures))
+    return 0;
+  Check_Type(erasures, T_ARRAY);
+  n = RARRAY_LEN(erasures);
+  if(n > max)
+    rb_raise(rb_eArgError, "too many erasures");
+  for (i = 0; i < n; i++)
+    erase[i] = NUM2INT(rb_ary_entry(erasures, i));
+  return n;
+}
+
+/* shared by correct and decode, returns the count or raises */
+static int
+semacode_correct_codewords(VALUE codewords, int w, int h, VALUE erasures)
+{
+  int erase[4096];
+  int n = semacode_erasures(erasures, erase, 4096);
+  int ret = iec16022ecc200correct(w, h, RSTRING_LEN(codewords),
+    (unsigned char *) RSTRING_PTR(codewords), n, erase);
+  if(ret == -2)
+    rb_raise(rb_eRangeError, "codewords do not fit a %dx%d barcode", w, h);
+  return ret;
+}
+
+/*
+  This corrects errors in codewords (a binary string, as returned by
+  Encoder#codewords) for a symbol of the given width and height. The
+  optional erasures are the indexes of codewords known to be bad, such
+  as those that could not be read, each of which takes half as much
+  error correction as an error whose place is not known.
+
+  It returns the corrected codewords and the number of codewords that
+  were wrong, or nil if there are too many errors to correct.
+*/
+static VALUE
+semacode_correct(int argc, VALUE *argv, VALUE self)
+{
+  VALUE codewords, width, height, erasures, ret;
+  int n;
+
+  rb_scan_args(argc, argv, "31", &codewords, &width, &height, &erasures);
+  codewords = rb_str_dup(StringValue(codewords));
+  n = semacode_correct_codewords(codewords, NUM2INT(width), NUM2INT(height), erasures);
+  if(n < 0)
+    return Qnil;
+  ret = rb_ary_new2(2);
+  rb_ary_push(ret, codewords);
+  rb_ary_push(ret, INT2FIX(n));
+  return ret;
+}
+
+/*
+  This decodes codewords (a binary string, as returned by
+  Encoder#codewords) for a symbol of the given width and height
+  back to the message, correcting any errors first. The optional
+  erasures are as for DataMatrix.correct.
+
+  It raises an ArgumentError if the errors cannot be corrected, or
+  if the data does not decode.
+*/
+static VALUE
+semacode_decode(int argc, VALUE *argv, VALUE self)
+{
+  VALUE codewords, width, height, erasures;
+  unsigned char message[2 * 4096 + 9];
+  int len;
+
+  rb_scan_args(argc, argv, "31", &codewords, &width, &height, &erasures);
+  codewords = rb_str_dup(StringValue(codewords));
+  if(semacode_correct_codewords(codewords, NUM2INT(width), NUM2INT(height), erasures) < 0)
+    rb_raise(rb_eArgError, "too many errors to correct");
+  len = iec16022ecc200decode(NUM2INT(width), NUM2INT(height),
+    (unsigned char *) RSTRING_PTR(codewords), message);
+  if(len < 0)
+    rb_raise(rb_eArgError, "codewords do not decode");
+  return rb_str_new((char *) message, len);
+}
+
+/*
+  This picks the size and encoding of each of an array of messages, as
+  Encoder.new would with the same options, but planning them together
+  so that the work for a tail several have in common is done only once.
+  This suits batches of messages made from one template.
+
+  It returns an array of [width, height, encoding] for each message, or
+  nil for a message too long for any size.
+*/
+static VALUE
+semacode_plans(int argc, VALUE *argv, VALUE self)
+{
+  VALUE messages, options, ret, vints, vptrs, vbytes;
+  int *len, *W, *H;
+  char **ptr, *bytes;
+  long n, i, total = 0;
+  int flags;
+
+  rb_scan_args(argc, argv, "11", &messages, &options);
+  Check_Type(messages, T_ARRAY);
+  flags = semacode_flags(options);
+  messages = rb_ary_dup(messages);
+  n = RARRAY_LEN(messages);
+  for (i = 0; i < n; i++) {
+    VALUE message = rb_ary_entry(messages, i);
+    StringValue(message);
+    rb_ary_store(messages, i, message);
+    total += 2 * RSTRING_LEN(message) + 3;
+  }
+
+  /* owned by the GC, so nothing leaks if the planner raises */
+  len = ALLOCV_N(int, vints, 3 * n + 1);
+  W = len + n;
+  H = W + n;
+  ptr = ALLOCV_N(char *, vptrs, 2 * n + 1);
+  bytes = ALLOCV_N(char, vbytes, total + 1);
+  for (i = 0; i < n; i++) {
+    VALUE message = rb_ary_entry(messages, i);
+    len[i] = RSTRING_LEN(message);
+    /* with the extra space the encoder appends */
+    ptr[i] = bytes;
+    memcpy(bytes, RSTRING_PTR(message), len[i]);
+    bytes[len[i]++] = ' ';
+    ptr[n + i] = bytes + len[i];
+    bytes += 2 * len[i] + 1;
+  }
+  iec16022ecc200plans(n, len, (unsigned char *const *) ptr, flags, W, H, ptr + n);
+
+  ret = rb_ary_new2(n);
+  for (i = 0; i < n; i++) {
+    if (W[i])
+      rb_ary_push(ret, rb_ary_new3(3, INT2FIX(W[i]), INT2FIX(H[i]), rb_str_new2(ptr[n + i])));
+    else
+      rb_ary_push(ret, Qnil);
+  }
+  ALLOCV_END(vbytes);
+  ALLOCV_END(vptrs);
+  ALLOCV_END(vints);
+  return ret;
+}
+
+/*
+  This returns the semacode bit packed, as a binary string. Each row,
+  top row first, starts with the leftmost module in the top bit of
+  its first byte, and is padded to a multiple of 64 bits, so that
+  renderers can work a word at a time. The bytes per row are given by
+  'row_stride'.
+*/
+static VALUE
+semacode_packed(VALUE self)
+{
+  semacode_t *semacode;
+  Data_Get_Struct(self, semacode_t, semacode);
+
+  if(semacode->data == NULL)
+    return Qnil;
+
+  return rb_str_new(semacode->data, semacode->stride * semacode->height);
+}
+
+/*  
+  This returns the number of bytes per row in the 'packed' string.
+*/
+static VALUE
+semacode_row_stride(VALUE self)
+{
+  semacode_t *semacode;
+  Data_Get_Struct(self, semacode_t, semacode);
+
+  return INT2FIX(semacode->stride);
+}
+
 void 
 Init_semacode_native()
 {
@@ -367,8 +788,8 @@ Init_semacode_native()
   
   rb_define_alloc_func(rb_cEncoder, semacode_allocate);
   
-  rb_define_method(rb_cEncoder, "initialize", semacode_init, 1);
-  rb_define_method(rb_cEncoder, "encode", semacode_encode, 1);  
+  rb_define_method(rb_cEncoder, "initialize", semacode_init, -1);
+  rb_define_method(rb_cEncoder, "encode", semacode_encode, -1);  
   rb_define_method(rb_cEncoder, "to_a", semacode_data, 0);
   rb_define_method(rb_cEncoder, "data", semacode_data, 0);  
   rb_define_method(rb_cEncoder, "encoding", semacode_encoded, 0);    
@@ -381,4 +802,15 @@ Init_semacode_native()
   rb_define_method(rb_cEncoder, "raw_encoded_length", semacode_raw_encoded_length, 0);    
   rb_define_method(rb_cEncoder, "symbol_size", semacode_symbol_size, 0);    
   rb_define_method(rb_cEncoder, "ecc_bytes", semacode_ecc_bytes, 0);    
+  rb_define_method(rb_cEncoder, "spare_codewords", semacode_spare_codewords, 0);
+  rb_define_method(rb_cEncoder, "area_saved", semacode_area_saved, 0);
+  rb_define_method(rb_cEncoder, "codewords", semacode_codewords, 0);
+  rb_define_method(rb_cEncoder, "packed", semacode_packed, 0);
+  rb_define_method(rb_cEncoder, "row_stride", semacode_row_stride, 0);
+
+  rb_define_module_function(rb_mSemacode, "codewords", semacode_read_codewords, 1);
+  rb_define_module_function(rb_mSemacode, "check", semacode_check, 3);
+  rb_define_module_function(rb_mSemacode, "correct", semacode_correct, -1);
+  rb_define_module_function(rb_mSemacode, "decode", semacode_decode, -1);
+  rb_define_module_function(rb_mSemacode, "plans", semacode_plans, -1);
 }
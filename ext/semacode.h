@@ -10,10 +10,22 @@ typedef struct semacode_t {
   int raw_encoded_length;
   int symbol_capacity;
   int ecc_bytes;
+  int spare;    /* data codewords left as padding */
+  int area_saved;       /* modules, against sizing by length alone */
+  int stride;
+  int flags;    /* IEC16022_ size selection flags */
   char *encoding;
-  char *data;
+  char *data;   /* bit packed, rows top down, stride bytes each */
+  char *buf;    /* kept between encodings: room for the largest symbol */
+  char *scratch;        /* and for the encoding and message, scratch_size bytes */
+  int scratch_size;
+  int busy;     /* being encoded, maybe with the GVL released */
 } semacode_t;
 
+/* the module at x, y (from the top left) is dark */
+#define SEMACODE_BIT(s, x, y) \
+  (((s)->data[(y) * (s)->stride + ((x) >> 3)] >> (7 - ((x) & 7))) & 1)
+
 #ifndef RB_STRING_VALUE
 #define RB_STRING_VALUE(s) (TYPE(s) == T_STRING ? (s) : (*(volatile VALUE *)&(s) = rb_str_to_str(s)))
 #endif
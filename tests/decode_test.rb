@@ -0,0 +1,85 @@
+require 'rubygems'
+require 'test/unit'
+require 'semacode'
+
+# Reading back the codewords of encoded symbols, checking, correcting
+# and decoding them
+class DecodeTest < Test::Unit::TestCase
+  MESSAGES = [
+    "http://www.ruby-lang.org",
+    "http://sohne.net/projects/semafox",
+    "1234567890123456",
+    "HELLO WORLD 2024",
+    "hello world, again",
+    "A*B>C\rD*E>F\r12",
+    "ABC.DEF/GHI:JKL.MNO/PQR:",
+    "\xC4\xE9\xFC\xF1".b * 4,
+    "a" * 500
+  ]
+
+  # the encoder appends a space to the message, in room left for it
+  def encode(message, options = {})
+    DataMatrix::Encoder.new(String.new(message, :capacity => message.bytesize + 2), options)
+  end
+
+  def test_codewords_read_back_from_the_rows
+    MESSAGES.each do |message|
+      semacode = encode(message)
+      assert_equal semacode.codewords, DataMatrix.codewords(semacode.data), message
+    end
+  end
+
+  def test_check
+    MESSAGES.each do |message|
+      semacode = encode(message)
+      codewords = semacode.codewords
+      assert DataMatrix.check(codewords, semacode.width, semacode.height), message
+      codewords.setbyte(0, codewords.getbyte(0) ^ 1)
+      assert !DataMatrix.check(codewords, semacode.width, semacode.height), message
+    end
+  end
+
+  def test_check_raises_for_the_wrong_size
+    semacode = encode("http://www.ruby-lang.org")
+    assert_raise(RangeError) { DataMatrix.check(semacode.codewords, 144, 144) }
+  end
+
+  def test_decode_round_trip
+    MESSAGES.each do |message|
+      semacode = encode(message)
+      decoded = DataMatrix.decode(semacode.codewords, semacode.width, semacode.height)
+      assert_equal message.b + " ", decoded, message
+    end
+  end
+
+  def test_decode_nul_in_c40_text_and_digit_runs
+    ["ABCDEFGHIJ\0KLMNOPQRST", "ABC\0\0DEF\0GHI123456", "1234567890\01234567890",
+     "abcdefghij\0klmnopqrst", "\0ABCDEFGHIJKLMNOP\0", "HELLO\x80\0WORLD 2024"].each do |message|
+      semacode = encode(message)
+      decoded = DataMatrix.decode(semacode.codewords, semacode.width, semacode.height)
+      assert_equal message.b + " ", decoded, "#{message.inspect} as #{semacode.encoding}"
+    end
+  end
+
+  def test_correct_errors
+    semacode = encode("http://sohne.net/projects/semafox")
+    codewords = semacode.codewords
+    bad = codewords.dup
+    [0, 5, 17].each { |i| bad.setbyte(i, bad.getbyte(i) ^ 0x5A) }
+    assert_equal [codewords, 3], DataMatrix.correct(bad, semacode.width, semacode.height)
+    assert_equal "http://sohne.net/projects/semafox ",
+      DataMatrix.decode(bad, semacode.width, semacode.height)
+  end
+
+  def test_correct_erasures
+    semacode = encode("http://sohne.net/projects/semafox")
+    codewords = semacode.codewords
+    erasures = (0...semacode.ecc_bytes).to_a
+    bad = codewords.dup
+    erasures.each { |i| bad.setbyte(i, 0) }
+    # as many erasures as error correction codewords, but not as many errors
+    assert_equal codewords, DataMatrix.correct(bad, semacode.width, semacode.height, erasures)[0]
+    assert_nil DataMatrix.correct(bad, semacode.width, semacode.height)
+    assert_raise(ArgumentError) { DataMatrix.decode(bad, semacode.width, semacode.height) }
+  end
+end
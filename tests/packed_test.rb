@@ -0,0 +1,30 @@
+require 'rubygems'
+require 'test/unit'
+require 'semacode'
+
+# The bit packed symbol against the same symbol as text
+class PackedTest < Test::Unit::TestCase
+  def encode(message, options = {})
+    DataMatrix::Encoder.new(String.new(message, :capacity => message.bytesize + 2), options)
+  end
+
+  def test_packed_rows_match_to_s
+    ["1", "http://www.ruby-lang.org", "a" * 300, "9" * 1500].each do |message|
+      [{}, { :shape => :rectangle }].each do |options|
+        semacode = encode(message, options)
+        stride = semacode.row_stride
+        assert_equal 0, stride % 8, "rows are padded to 64 bits"
+        assert stride * 8 >= semacode.width
+        packed = semacode.packed
+        assert_equal stride * semacode.height, packed.bytesize
+        rows = semacode.to_s.split(",")
+        assert_equal semacode.height, rows.size
+        rows.each_with_index do |row, y|
+          bits = packed[y * stride, stride].unpack("B*")[0]
+          assert_equal row, bits[0, semacode.width], "row #{y} of #{semacode.width}x#{semacode.height}"
+          assert_match(/\A0*\z/, bits[semacode.width..-1], "padding of row #{y}")
+        end
+      end
+    end
+  end
+end
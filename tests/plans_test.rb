@@ -0,0 +1,40 @@
+require 'rubygems'
+require 'test/unit'
+require 'semacode'
+
+# DataMatrix.plans against Encoder.new for each message on its own
+class PlansTest < Test::Unit::TestCase
+  def messages
+    srand(22)
+    # a campaign of one template, sharing tails, and a few others
+    Array.new(200) { |i| "https://example.com/campaign?id=#{rand(10000000)}&src=label&v=#{i % 3}" } +
+      Array.new(40) { |i| "HTTP://EXAMPLE.COM/P/#{rand(100000)}/ITEM" } +
+      Array.new(40) { Array.new(1 + rand(60)) { (32 + rand(95)).chr }.join } +
+      Array.new(20) { Array.new(1 + rand(30)) { rand(256).chr }.join.b } +
+      ["1234567890" * 20, "a" * 600, "A\0B\0C"]
+  end
+
+  def test_plans_match_the_encoder
+    list = messages
+    [{}, { :shape => :rectangle }, { :shape => :any, :dmre => true }, { :max_size => 40 }].each do |options|
+      plans = DataMatrix.plans(list, options)
+      assert_equal list.size, plans.size
+      list.zip(plans).each do |message, plan|
+        semacode = begin
+          DataMatrix::Encoder.new(message, options)
+        rescue RangeError
+          nil
+        end
+        if semacode
+          assert_equal [semacode.width, semacode.height, semacode.encoding], plan, "#{message.inspect} #{options.inspect}"
+        else
+          assert_nil plan, message.inspect
+        end
+      end
+    end
+  end
+
+  def test_plans_raise_for_a_message_too_long
+    assert_raise(RangeError) { DataMatrix.plans(["1", "x" * 1600]) }
+  end
+end
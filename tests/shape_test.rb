@@ -0,0 +1,103 @@
+require 'rubygems'
+require 'test/unit'
+require 'semacode'
+
+# The size and shape of symbol picked for the options given
+class ShapeTest < Test::Unit::TestCase
+  def encode(message, options = {})
+    DataMatrix::Encoder.new(String.new(message, :capacity => message.bytesize + 2), options)
+  end
+
+  def dimensions(semacode)
+    "#{semacode.width}x#{semacode.height}"
+  end
+
+  def test_square_by_default
+    assert_equal "10x10", dimensions(encode("1"))
+    assert_equal "20x20", dimensions(encode("http://www.ruby-lang.org"))
+  end
+
+  def test_rectangle_for_short_messages
+    assert_equal "18x8", dimensions(encode("1", :shape => :rectangle))
+    assert_equal "18x8", dimensions(encode("HELLO", :shape => :rectangle))
+    assert_equal "36x12", dimensions(encode("http://www.ruby-lang.org", :shape => :rectangle))
+    assert_equal "48x16", dimensions(encode("1" * 90, :shape => :rectangle))
+  end
+
+  def test_square_when_too_long_for_a_rectangle
+    assert_equal "32x32", dimensions(encode("1" * 120, :shape => :rectangle))
+  end
+
+  def test_shape_kept_for_later_encodes
+    semacode = encode("1", :shape => :rectangle)
+    semacode.encode(String.new("HELLO", :capacity => 8))
+    assert_equal "18x8", dimensions(semacode)
+    semacode.encode(String.new("HELLO", :capacity => 8), :shape => :square)
+    assert_equal "12x12", dimensions(semacode)
+  end
+
+  def test_unknown_shape
+    assert_raise(ArgumentError) { encode("1", :shape => :round) }
+  end
+
+  def test_dmre_only_when_asked_for
+    assert_equal "64x16", dimensions(encode("1" * 120, :dmre => true))
+    assert_equal "96x8", dimensions(encode("A" * 50, :dmre => true))
+    (1..150).each do |n|
+      semacode = encode("1" * n, :shape => :rectangle)
+      next if semacode.width == semacode.height
+      assert semacode.width <= 48 && semacode.height <= 16, "#{n} digits in #{dimensions(semacode)}"
+    end
+  end
+
+  def test_dmre_with_rectangles
+    assert_equal "64x16", dimensions(encode("1" * 120, :shape => :rectangle, :dmre => true))
+  end
+
+  def test_any_shape_is_the_smallest
+    srand(16022)
+    messages = ["1", "HELLO", "1" * 90, "A" * 50] +
+      Array.new(100) { Array.new(1 + rand(60)) { (32 + rand(95)).chr }.join } +
+      Array.new(50) { Array.new(1 + rand(30)) { (128 + rand(128)).chr }.join.b }
+    messages.each do |message|
+      [false, true].each do |dmre|
+        area = lambda { |options| semacode = encode(message, options); semacode.width * semacode.height }
+        smallest = [area.call(:shape => :square), area.call(:shape => :rectangle, :dmre => dmre)].min
+        assert_equal smallest, area.call(:shape => :any, :dmre => dmre), message.inspect
+      end
+    end
+  end
+
+  def test_dmre_with_a_square_shape
+    assert_raise(ArgumentError) { encode("1", :shape => :square, :dmre => true) }
+  end
+
+  def test_min_and_max_size
+    assert_equal "32x32", dimensions(encode("1" * 40, :min_size => 30))
+    assert_equal "120x8", dimensions(encode("1" * 90, :shape => :rectangle, :dmre => true, :min_size => 60))
+    assert_equal "48x16", dimensions(encode("1" * 90, :shape => :any))
+    assert_equal "32x32", dimensions(encode("1" * 90, :shape => :any, :max_size => 40))
+    assert_raise(RangeError) { encode("1" * 90, :max_size => 20) }
+    assert_raise(ArgumentError) { encode("1", :min_size => 0) }
+    assert_raise(ArgumentError) { encode("1", :max_size => 145) }
+    assert_raise(ArgumentError) { encode("1", :min_size => 40, :max_size => 20) }
+  end
+
+  def test_area_saved
+    # the length alone would have picked 22x22 and 26x26
+    assert_equal 84, encode("http://www.ruby-lang.org").area_saved
+    assert_equal 276, encode("1" * 40).area_saved
+    assert_equal 0, encode("1").area_saved
+  end
+
+  def test_spare_codewords
+    assert_equal 1, encode("1").spare_codewords
+    ["1", "HELLO", "http://www.ruby-lang.org", "1" * 90, "a" * 300].each do |message|
+      semacode = encode(message)
+      spare = semacode.spare_codewords
+      assert semacode.raw_encoded_length + spare <= semacode.symbol_size, message
+      # as many more bytes encoded one to a codeword still fit
+      assert_equal dimensions(semacode), dimensions(encode(message + "!" * spare)), message
+    end
+  end
+end